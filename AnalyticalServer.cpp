@@ -14,15 +14,44 @@
 #include <sstream>
 #include <string>
 #include <vector>
+#include <list>
 #include <map>
+#include <queue>
 #include <algorithm>
 #include <cstdint>
+#include <cinttypes>
+#include <cmath>
+#include <charconv>
+#include <atomic>
 #include <pthread.h>
 #include <poll.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <signal.h>
+
+//includes for compressed trade files
+#include <zlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+//includes for NUMA aware placement
+#ifdef WITH_NUMA
+#include <numa.h>
+#endif
+
+//shared memory table of the latest bars
+#include "SharedBarTable.h"
 
 //includes for Seasocks websocket library
 #include "seasocks/PrintfLogger.h"
@@ -39,12 +68,25 @@
 #include "g2log.h"
 #include <iomanip>
 #include <thread>
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 
 
 using namespace std;
 using namespace seasocks;
 
 
+//Per event trace of the FSM (events, bar updates, emitted bars). It costs more than the FSM work itself, build with
+//-DFSM_NO_TRACE to compile it out (FSM_TRACE=0 ./build.sh). Errors, evictions and reports are logged either way
+#ifdef FSM_NO_TRACE
+#define FSM_TRACE  if (true) {} else LOG(INFO)
+#else
+#define FSM_TRACE  LOG(INFO)
+#endif
+
+
 //time to wait before playing trade packets into the system
 const int pre_publish_wait_secs = 60;
 
@@ -58,6 +100,86 @@ struct tradepacket {
 };
 
 
+//Compression of a trade file, detected from its magic bytes
+enum Compression_Type { COMPRESSION_NONE = 0, 
+                        COMPRESSION_GZIP = 1, 
+                        COMPRESSION_ZSTD = 2 
+                      };
+
+vector<string> Compression_Type_Name = { "none", 
+                                         "gzip", 
+                                         "zstd" 
+                                       };
+
+
+//Trade source. Every trade file is read and parsed by its own thread and delivered to the merger (Worker 1) thru its own pipe
+//Compressed files are decompressed by a decompressor thread into a second pipe that feeds the parser
+struct TradeSource {
+	string      path;
+	int         pfd[2];
+	pthread_t   thread;
+	uint64_t    trades;   //trades read from the source
+	uint64_t    ticks;    //time ticks of the trades of other backends (sharded mode). Not counted as trades
+	uint64_t    rejected; //lines without a symbol that fits a trade packet. An empty symbol is a time tick down the pipeline
+	tradepacket head;     //next trade of the source waiting in the merge
+
+	Compression_Type compression;
+	int              compressed_fd;
+	int              dfd[2];               //decompressed data pipe
+	pthread_t        decompressor;
+	uint64_t         compressed_bytes;
+	uint64_t         decompressed_bytes;
+	uint64_t         decompress_tasks;     //blocks decompressed in parallel. 1 for files that are not splittable
+	double           decompress_secs;      //time spent decompressing, summed over the decompression threads
+	double           decompress_wall_secs; //lifetime of the decompressor, including waits on the parser
+	bool             decompress_failed;    //corrupt or truncated data. The source stops at the first bad block
+};
+
+
+//Parallel decompression task : a run of blocks of a compressed trade file and its decompressed output
+struct DecompressTask {
+	size_t offset;
+	size_t len;
+	string out;
+	double busy_secs;
+	bool   ok;
+	bool   finished;   //set under the pool lock once out / busy_secs / ok are final
+};
+
+
+//Fixed pool of decompress_threads workers of a compressed trade file. The workers take the queued tasks in file order
+struct DecompressPool {
+	const unsigned char    *data;
+	Compression_Type        compression;
+	mutex                   lock;
+	condition_variable      queued;     //a task was queued, or the pool is stopping
+	condition_variable      finished;   //a task finished
+	deque<DecompressTask*>  queue;      //tasks not started yet
+	bool                    stopping;
+};
+
+
+//Trade held in the reorder window
+struct ReorderEntry {
+	uint64_t    seq;
+	tradepacket tp;
+
+	bool operator>(const ReorderEntry & other) const {
+		return tp.ts2 > other.tp.ts2 or (tp.ts2 == other.tp.ts2 and seq > other.seq);
+	}
+};
+
+
+//Counters of the k-way merge of the trade sources
+struct TradeMergeStats {
+	uint64_t merged;      //trades merged from all the sources
+	uint64_t ticks;       //time ticks merged from all the sources. Ordered with the trades, not counted in the other stats
+	uint64_t late;        //trades older than a trade merged before them
+	uint64_t reordered;   //late trades put back in TS2 order by the reorder window
+	uint64_t dropped;     //late trades older than the reorder window. Not delivered to the FSM
+};
+
+
 //15 Seconds Bar Context
 struct BarCntxt {
 	char         sym[15];
@@ -72,11 +194,177 @@ struct BarCntxt {
 };
 
 
+//Price buckets of a footprint
+const int footprint_buckets = 32;
+
+
+//Footprint (volume at price profile) of the current bar of a symbol. The volume of the trades is added to a fixed array of
+//price buckets, split into buy and sell volume by the tick rule. The buckets are centered on the first trade of the bar. A trade
+//outside of them doubles the bucket width, merging the buckets in pairs, and the width halves again after bars that use
+//only a few buckets. So the profile adapts to the price range of the symbol without ever allocating
+struct Footprint {
+	double base;         //lower price of bucket 0
+	double width;        //price range of a bucket. 0 until the first trade of the symbol
+	int    lo;           //buckets lo to hi have volume. lo > hi when the bar has no volume yet
+	int    hi;
+	double last_price;   //previous trade, for the tick rule
+	int    last_side;    //+1 buy, -1 sell, 0 not known yet
+	bool   dirty;        //changed since the last update was sent
+	double volume[footprint_buckets];
+	double buy[footprint_buckets];
+	double sell[footprint_buckets];
+};
+
+
+//Bar context of a symbol in the FSM bar cache, with the activity used to evict idle symbols
+struct SymbolCntxt {
+	BarCntxt bar;
+	uint64_t last_trade_time;   //TS2 of the last trade of the symbol
+	bool     referenced;        //traded since the eviction clock hand last passed the symbol
+
+	unique_ptr<Footprint> footprint;   //with -F only
+};
+
+
+//Bar context of an evicted symbol, kept to resume its bar sequence when it trades again. The symbol is the key of the spill cache
+//and the bar starts fifteen_sec_nanosecs before its close, so neither is stored
+struct SpilledCntxt {
+	list<const string*>::iterator order;   //position in the eviction order of the spill cache, for its cap
+	unsigned int bar_num;
+	uint64_t     bar_close_time;
+	double       bar_open;
+	double       bar_high;
+	double       bar_low;
+	double       bar_close;
+	double       bar_volume;
+};
+
+
+//Counters of the FSM bar cache
+struct FSMCacheStats {
+	uint64_t ttl_evictions;   //symbols evicted after no trades for fsm_symbol_ttl
+	uint64_t cap_evictions;   //symbols evicted to stay within fsm_max_symbols
+	uint64_t resumed;         //evicted symbols that traded again
+	uint64_t spill_drops;     //spilled symbols forgotten to stay within fsm_max_spilled
+	uint64_t sweeps;          //timer expiry sweeps of the bar cache
+	uint64_t swept;           //bar contexts walked by the sweeps
+	size_t   max_sweep;       //bar contexts walked by the largest sweep
+};
+
+
+//Synthetic instrument. Price is derived from the latest prices of its constituent (leg) symbols:
+//price = leg[0]^exponent[0] * leg[1]^exponent[1] * ... with exponents of +1 (multiply) or -1 (divide)
+struct SyntheticInstrument {
+	char           sym[15];
+	vector<string> legs;
+	vector<int>    exponents;
+};
+
+
+//Stages of the pipeline, for the CPU placement of their threads (-A)
+enum Pipeline_Stage { STAGE_READER = 0,       //Worker 1 : merger of the trade sources
+                      STAGE_SOURCE = 1,       //trade source readers (parsers)
+                      STAGE_DECOMPRESS = 2,   //decompressors of the compressed trade files and their pools of -j workers
+                      STAGE_FSM = 3,          //Worker 2 : FSM thread, FSM shards of the batch mode
+                      STAGE_PUBLISHER = 4,    //Worker 3 : websocket publisher
+                      STAGE_COUNT
+                    };
+
+vector<string> Pipeline_Stage_Name = { "reader", 
+                                       "source", 
+                                       "decompress", 
+                                       "fsm", 
+                                       "publisher", 
+                                       "STAGE_INVALID" 
+                                     };
+
+
+//Output formats of the batch mode
+enum Batch_Format { BATCH_FORMAT_CSV = 0, 
+                    BATCH_FORMAT_BIN = 1, 
+                    BATCH_FORMAT_COUNT
+                  };
+
+vector<string> Batch_Format_Name = { "csv", 
+                                     "bin", 
+                                     "BATCH_FORMAT_INVALID" 
+                                   };
+
+
+//Buffered writer of the bars of a batch mode FSM shard. CSV rows are formatted into a text buffer, binary rows are collected
+//into columns. Either is written out a row group at a time
+struct BarWriter {
+	int              fd;
+	Batch_Format     format;
+	string           text;
+	size_t           rows;          //rows in the current row group
+	vector<uint8_t>  type;
+	vector<char>     sym;           //15 bytes per row
+	vector<uint32_t> bar_num;
+	vector<uint64_t> bar_start_time;
+	vector<uint64_t> bar_close_time;
+	vector<double>   bar_open;
+	vector<double>   bar_high;
+	vector<double>   bar_low;
+	vector<double>   bar_close;
+	vector<double>   bar_volume;
+	uint64_t         total_rows;
+	uint64_t         bytes;
+};
+
+
+//Backend process of the sharded mode (-S), seen from the gateway. The backend streams its bars on bars_fd (stream socket) and
+//gets the interest of the gateway on control_fd (seqpacket socket, one message per record)
+struct ShardBackend {
+	pid_t pid;
+	int   bars_fd;      //-1 once the backend is down
+	int   control_fd;
+
+	deque<string> control_queue;   //interest messages the control socket had no room for, in order. Sent when it is writable
+};
+
+
+//Interest message (gateway to backend). The gateway has subscribers (add = 1) or no subscribers left (add = 0) for a symbol or
+//a glob pattern. Only the bytes of the key that are used are sent
+struct ShardInterestMsg {
+	uint32_t add;
+	char     key[256];
+};
+
+
+//Subscription message from a websocket client. symbols holds symbols and glob patterns
+struct SubscriptionRequest {
+	string         event;
+	vector<string> symbols;
+	string         interval;
+};
+
+
+//Symbol glob pattern compiled once at subscription time. * matches any run of characters, ? matches any single character
+struct SymbolPattern {
+	string glob;
+	string prefix;      //literal characters before the first wildcard, for a quick reject
+	bool   match_all;   //pattern is just *
+};
+
+
+//Fixed point format of the prices and volumes of the symbols matching a pattern in the published messages
+struct FixedPointFormat {
+	SymbolPattern pattern;
+	int           price_decimals;
+	int           volume_decimals;
+};
+
+
 //Bar Types
 enum Bar_Type {  CLOSING_BAR = 0, 
                  TRADE_BAR = 1, 
                  TIMER_EXP_CLOSING_BAR = 2, 
                  TIMER_EXP_OPENING_BAR = 3, 
+                 EMPTY_BARS_GAP = 4, 
+                 SYMBOL_EVICTED = 5, 
+                 FOOTPRINT_UPDATE = 6, 
+                 FOOTPRINT_CLOSED = 7, 
                  BAR_TYPE_COUNT
               };
 
@@ -84,9 +372,53 @@ vector<string> Bar_Type_Name = { "CLOSING_BAR",
                                  "TRADE_BAR", 
                                  "TIMER_EXP_CLOSING_BAR", 
                                  "TIMER_EXP_OPENING_BAR", 
+                                 "EMPTY_BARS_GAP", 
+                                 "SYMBOL_EVICTED", 
+                                 "FOOTPRINT_UPDATE", 
+                                 "FOOTPRINT_CLOSED", 
                                  "BAR_TYPE_INVALID" 
                                };
 
+
+//Bar message (Sent from Worker 2 to Worker 3)
+//An EMPTY_BARS_GAP message stands for gap_bars consecutive empty bars (no trades, O = H = L = C = previous close, volume 0).
+//bar is the first of them. Bar k of the gap is bar.bar_num + k and starts k * bar_period_nanosecs after bar.bar_start_time
+//A SYMBOL_EVICTED message tells the publisher that the FSM dropped the idle symbol bar.sym. Only bar.sym is set
+struct BarMsg {
+	Bar_Type     type;
+	unsigned int gap_bars;
+	BarCntxt     bar;
+};
+
+
+//Footprint message (Sent from Worker 2 to Worker 3 on the bars pipe). FOOTPRINT_UPDATE is the profile of the current bar so far,
+//FOOTPRINT_CLOSED the final profile of a bar, sent after its closing bar. Both start with the type like a BarMsg, so the
+//publisher knows the size of a message from its type
+struct FootprintMsg {
+	Bar_Type     type;
+	unsigned int bar_num;
+	char         sym[15];
+	int          lo;
+	int          hi;
+	double       base;
+	double       width;
+	double       volume[footprint_buckets];
+	double       buy[footprint_buckets];
+	double       sell[footprint_buckets];
+};
+
+
+//Inbound bar stream of the publisher : the pipe from the FSM thread, or the socket of a backend in the sharded mode.
+//carry holds the bytes of a message split across two reads
+struct BarInbound {
+	int      fd;
+	int      shard;      //backend of the stream. -1 for the FSM pipe
+	bool     pending;    //may have bars left to read
+	uint64_t messages;   //bar and footprint messages read since the last report
+	size_t   carry;
+	alignas(BarMsg) char carry_buf[sizeof(FootprintMsg)];
+};
+
 //FSM States
 enum FSM_States {  FSM_STARTING = 0, 
                    FSM_READY = 1, 
@@ -114,16 +446,33 @@ vector<string> FSM_Event_Type_Name = { "TRADE_PKT_ARRIVAL",
                                      };
 
 
-//FSM Events Data
+//Clock sources that drive the TIMER_EXPIRY events closing the bars
+enum FSM_Clock_Types { FSM_CLOCK_EVENT_TIME = 0,     //replays. time advances with the TS2 of the trades
+                       FSM_CLOCK_WALL_TIME = 1,      //live feeds. a timerfd on the wall clock fires at the bar close boundaries
+                       FSM_CLOCK_TYPE_COUNT
+                     };
 
-struct FSM_Event_Data_Trade_Pkt {
-	char   sym[15];
-	double price;
-	double qty;
-	uint64_t ts2;
+vector<string> FSM_Clock_Type_Name = { "event", 
+                                       "wall", 
+                                       "FSM_CLOCK_INVALID" 
+                                     };
+
+
+//FSM Clock
+struct FSM_Clock {
+	FSM_Clock_Types type;
+	int             timer_fd;    //wall clock only
+	uint64_t        armed_ts;    //time the timer is armed for. 0 when disarmed
 };
 
 
+//FSM Events Data
+
+//The trade packet delivered by worker 1 is the event data itself, so a batch of trade packets read from the pipe
+//is fired into the FSM without being copied into FSM_EVENTs
+typedef tradepacket FSM_Event_Data_Trade_Pkt;
+
+
 struct FSM_Event_Data_Timer_Exp {
 	uint64_t ts;
 };
@@ -140,624 +489,4079 @@ struct FSM_EVENT {
 };
 
 
-//FSM Event Handler Type
-typedef bool (*FSM_EVENT_HANDLER) (FSM_EVENT &);
+//Event data type carried by each event type
+template <FSM_Event_Types E> struct FSM_Event_Payload;
+template <> struct FSM_Event_Payload<TRADE_PKT_ARRIVAL> { typedef FSM_Event_Data_Trade_Pkt type; };
+template <> struct FSM_Event_Payload<TIMER_EXPIRY>      { typedef FSM_Event_Data_Timer_Exp type; };
 
 
-//Function prototypes
-void usage(int argc, char* argv[]);
+//State of an FSM. The live server runs one FSM, the batch mode one per symbol shard. The FSM functions get it explicitly
+struct FSMState {
+	FSM_States curr_state;
 
-void *trade_data_reader(void *msg);
+	//Caches
+	map<string, SymbolCntxt>  bar_cntxt_cache;
+	map<string, BarCntxt>     outbound_cache;
+	map<string, SpilledCntxt> spilled_cntxt_cache;
 
-void *fsm_thread_bar_calc(void *msg);
+	list<const string*> spilled_order;       //spilled symbols, oldest eviction first. Points to the keys of the spill cache
+	vector<string>      spilled_open_bars;   //evicted while their bar was open. The closing bar is emitted from the spill cache
 
-void *publisher_thread_publish_bars(void *msg);
+	map<string, SymbolCntxt>::iterator evict_hand;   //clock hand of the eviction on the bar cache
+	FSMCacheStats cache_stats;
 
-bool fsm_fire_event(FSM_EVENT & fsm_ev);
+	uint64_t next_bar_close_time;   //earliest bar close time in the bar cache (a lower bound, bars only move forward)
+	uint64_t last_expiry_ts;        //latest time of a timer expiry. Evicted symbols catch up to it when they come back
 
-bool process_fsm_starting(FSM_EVENT & fsm_ev);
+	BarWriter *bar_writer;          //NULL when the bars go to the publisher
 
-bool process_fsm_down(FSM_EVENT & fsm_ev);
+	vector<SymbolCntxt*> dirty_footprints;    //footprint changed in the current batch of trades. Conflated into one update
+	string               footprint_updates;   //updates of the batch, sent down the pipe in one write
 
-bool process_fsm_ready_ev_trd_pkt_arrival(FSM_EVENT & fsm_ev);
+	FSMState() : curr_state(FSM_STARTING), evict_hand(bar_cntxt_cache.end()), cache_stats(),
+	             next_bar_close_time(UINT64_MAX), last_expiry_ts(0), bar_writer(NULL) {}
+};
 
-bool process_fsm_ready_ev_tmr_expiry(FSM_EVENT & fsm_ev);
 
-bool process_fsm_event(FSM_EVENT & fsm_ev);
+//Max number of trade packets read from the pipe and fired into the FSM as one batch
+const size_t fsm_batch_size = 256;
 
-bool fsm_emit_bar(BarCntxt barcntxt, Bar_Type bt);
 
-vector<string> tokenize(const char *str, char c);
+//FSM shard of the batch mode. Runs the FSM on the symbols routed to it and writes their bars.
+//The FSM state and the bars writer are built by the shard thread once it is pinned, so that it first touches them
+struct FSMShard {
+	int         pfd[2];    //trade packets and time ticks from Worker 1
+	pthread_t   thread;
+	string      path;
+	int         fd;        //bars file
+	uint64_t    tick_ts;   //latest time delivered to the shard
+	uint64_t    trades;
+	tradepacket pending[fsm_batch_size];
+	size_t      npending;  //packets buffered by Worker 1 for the shard, up to a pipe read of the shard FSM
+	unique_ptr<BarWriter> writer;
+	unique_ptr<FSMState>  fsm;
+};
 
-bool parse_trade(string line, map<string, string> & trdmap);
 
-bool parse_subscription (string line, map<string, string> & subscmap);
+//Function prototypes
+void usage(int argc, char* argv[]);
 
+void *trade_data_reader(void *msg);
 
+void *trade_source_reader(void *msg);
 
-//FSM Handler Table
-FSM_EVENT_HANDLER FSM_Ev_Handler_Table[FSM_STATE_COUNT][EVENT_TYPE_COUNT] = {
-																				process_fsm_starting, process_fsm_starting,
-																				process_fsm_ready_ev_trd_pkt_arrival, process_fsm_ready_ev_tmr_expiry,
-																				process_fsm_down, process_fsm_down	
-																			};
+bool read_tradepacket(int fd, tradepacket & tp);
 
-// Pipes for IPC between threads
-int pfd_w1_w2[2];  
-int pfd_w2_w3[2];
+bool read_all(int fd, char *buf, size_t len);
 
-//FSM State
-FSM_States fsm_curr_state = FSM_STARTING;
+bool trade_line_field(const char *line, const char *key, string & val);
 
-//Caches
-map<string, BarCntxt> bar_cntxt_cache;
-map<string, BarCntxt> outbound_cache;
-map<string, BarCntxt> pubs_bar_cache;
+bool trade_line_owned(const char *line, tradepacket & tick);
 
-//time interval between bars in nanoseconds. 
-const uint64_t fifteen_sec_nanosecs = 15 * 1000000000UL ;
+FILE *open_trade_source(TradeSource & source);
 
+void *trade_source_decompressor(void *msg);
+void decompress_worker(DecompressPool *pool);
 
+vector< pair<size_t, size_t> > split_compressed_blocks(const unsigned char *data, size_t len, Compression_Type ct);
 
+bool decompress_block(const unsigned char *data, size_t len, Compression_Type ct, int fd, string *out, uint64_t & out_bytes, double & busy_secs);
 
-//MAIN PROGRAM
-int main( int argc, char* argv[] )
-{
+bool write_all(int fd, const char *buf, size_t len);
 
-    bool help  = false;
-    bool debug = false;
+void *fsm_thread_bar_calc(void *msg);
 
-	char tradefile[25];
-	strcpy(tradefile, "trades.json");
+void *publisher_thread_publish_bars(void *msg);
 
-	int c;
+bool fsm_fire_event(FSMState & fsm, FSM_EVENT & fsm_ev);
 
-    while ( (c = getopt(argc, argv, "f:dh")) != -1) {
-        switch(c)
-        {
-            case 'f' :
-                strcpy(tradefile, optarg) ;
-                break;
-            case 'd' :
-                debug = true;
-                break;
-            case 'h' :
-                help = true;
-                break;
-        }
-    }
+bool process_fsm_starting(FSMState & fsm);
 
-	//if help requested, display and exit
-    if (help) {
-        usage(argc, argv);
-        exit(0);
-    }
+bool process_fsm_down(FSMState & fsm);
 
+bool process_fsm_ready_ev_trd_pkt_arrival(FSMState & fsm, const FSM_Event_Data_Trade_Pkt & trd_pkt);
 
-	//Initialize the g2log logger
-	g2LogWorker g2log(argv[0], "./");
-	g2::initializeLogging(&g2log);
+bool process_fsm_ready_ev_tmr_expiry(FSMState & fsm, const FSM_Event_Data_Timer_Exp & tmr_exp);
 
-	cout      << ".................ANLALYTICAL SERVER (OHLC 15 SECONDS)...................." << endl;
-	LOG(INFO) << ".................ANLALYTICAL SERVER (OHLC 15 SECONDS)...................." << endl;
+void fsm_roll_bar(BarCntxt & barcntxt);
 
-	cout      << "Using trades file : " << tradefile << endl;
-	LOG(INFO) << "Using trades file : " << tradefile << endl;
+bool fsm_clock_init();
 
-	pthread_t trade_reader;
-	pthread_t fsm_thread;
-	pthread_t publisher_thread;
+uint64_t fsm_clock_now();
 
-	//create the pipe for data sharing between worker 1 and worker 2
-	pipe(pfd_w1_w2);
+uint64_t fsm_clock_bar_start(uint64_t ts2);
 
-	//create the pipe for data sharing between worker 2 and worker 3
-	pipe(pfd_w2_w3);
+void fsm_clock_arm(FSMState & fsm);
 
+void fsm_clock_tick(FSMState & fsm);
 
-	int retval_1;
+void fsm_update_synthetics(FSMState & fsm, const string & sym, uint64_t ts2);
 
-	retval_1 = pthread_create(&trade_reader, NULL, trade_data_reader, (void *) tradefile);
+SymbolCntxt *fsm_find_cntxt(FSMState & fsm, const string & sym);
 
-	int retval_2;
-	const char *fsm = "FSM Thread";
-	retval_2 = pthread_create(&fsm_thread, NULL, fsm_thread_bar_calc, (void *) fsm);
+SymbolCntxt & fsm_new_cntxt(FSMState & fsm, const string & sym);
 
-	int retval_3;
-	const char *publisher = "Publisher Thread";
-	retval_3 = pthread_create(&publisher_thread, NULL, publisher_thread_publish_bars, (void *) publisher);
+map<string, SymbolCntxt>::iterator fsm_evict_cntxt(FSMState & fsm, map<string, SymbolCntxt>::iterator it);
 
-	pthread_join(trade_reader, NULL);
-	pthread_join(fsm_thread, NULL);
-	pthread_join(publisher_thread, NULL);
+void fsm_close_spilled(FSMState & fsm, SpilledCntxt & spill, const string & sym);
 
-	return 0;
-}
+uint64_t fsm_close_spilled_bars(FSMState & fsm, uint64_t ts);
 
+void fsm_report_cache_stats(FSMState & fsm);
 
+bool load_synthetics(const char *fname);
 
-//Usage
-void usage(int argc, char* argv[]) {
-    cout << argv[0] << " -f <filename> -dh" << endl;
-    cout << "       f - trade filename" << endl;
-    cout << "       d - print debug" << endl;
-    cout << "       h - help" << endl;
-}
+void fsm_close_bars_until(FSMState & fsm, SymbolCntxt & symcntxt, uint64_t ts, Bar_Type bt);
 
+bool fsm_emit_bar(FSMState & fsm, const BarCntxt & barcntxt, Bar_Type bt);
 
+void fsm_emit_gap(FSMState & fsm, const BarCntxt & first, uint64_t gap_bars);
 
-//Thread 1: Read the trade data, format trade packets and deliver to FSM
-void *trade_data_reader(void *msg) {
+void fsm_benchmark(unsigned long num_trades);
 
-	char *fname = static_cast<char*>(msg);
+bool bench_fsm_starting(FSMState & fsm, FSM_EVENT & fsm_ev);
 
-	//open the trades file
-	ifstream trdfile(fname);
+bool bench_fsm_ready_ev_trd_pkt_arrival(FSMState & fsm, FSM_EVENT & fsm_ev);
 
-	cout      << "Will wait for " << pre_publish_wait_secs << " seconds for you to establish the client subscriptions" << endl;
-	LOG(INFO) << "Will wait for " << pre_publish_wait_secs << " seconds for you to establish the client subscriptions" << endl;
+bool bench_fsm_ready_ev_tmr_expiry(FSMState & fsm, FSM_EVENT & fsm_ev);
 
-	for ( int i = 0; i <= pre_publish_wait_secs; i++ ) {
-		cout << "..";
-		sleep(1);
-	}
+bool bench_fsm_down(FSMState & fsm, FSM_EVENT & fsm_ev);
 
-	string line;
-	while(getline(trdfile, line)) {
-		LOG(INFO) << "Read line: " << line << endl;
-		string delchars = "{} \"";
-		for (char c: delchars) {
-			line.erase( remove(line.begin(), line.end(), c), line.end());
-		}
-		LOG(INFO)  << "Worker 1 (Trade Reader) => read line: " << line << endl;
+void serializer_benchmark(unsigned long num_msgs);
 
-		map<string, string> trademap;
-		parse_trade(line, trademap);
+bool load_fixed_point_formats(const char *fname);
 
-		string symbol;
-		double price;
-		double qty;
-		uint64_t ts2;
+const FixedPointFormat *fixed_point_format(const string & sym);
 
-		for (auto itr = trademap.begin(); itr != trademap.end(); itr++) {
-			string key = itr->first;
-			string val = itr->second;
+size_t serialize_bar(const BarMsg & barmsg, const FixedPointFormat *fmt, char *buf);
 
-			if (key == "sym") {
-				symbol = val;
-			}
-			else if (key == "P") {
-				istringstream is(val);
-				is>>price;
-			}
-			else if (key == "Q") {
-				istringstream is(val);
-				is>>qty;
-			}
-			else if (key == "TS2") {
-				istringstream is(val);
-				is>>ts2;
-			}
-		}
-		
-		LOG(INFO)  << "Worker 1( Trade Reader) => parsed trade: " << "sym = " << symbol << ", P = " << price << ", Q = " << qty << ", TS2 = " << ts2 << endl;
+size_t serialize_footprint(const FootprintMsg & fpmsg, const FixedPointFormat *fmt, char *buf);
 
-		//Create trade packet and deliver
-		tradepacket tp;
-		strcpy(tp.sym, symbol.c_str());
-		tp.price = price;
-		tp.qty   = qty;
-		tp.ts2   = ts2;
+bool load_stage_affinity(const string & spec);
 
-		//write into the pipe that takes the data to fsm thread
-		write(pfd_w1_w2[1], &tp, sizeof(tp));
-	}
-}
+bool parse_cpu_list(const string & list, vector<int> & cpus);
 
+string format_cpu_list(const vector<int> & cpus);
 
+int cpu_numa_node(int cpu);
 
+void stage_thread_start(Pipeline_Stage stage, const char *name);
 
-//Parse trade data into a map of values
-bool parse_trade(string line, map<string, string> & trdmap) {
+void report_topology();
 
-	char item_delimiter = ',';
-	char key_delimiter  = ':';
-	vector<string> items;
-	items = tokenize(line.c_str(), item_delimiter);
+void shard_stage_cpus();
 
-	for (string item : items) {
+bool spin_wait(chrono::steady_clock::time_point last_work);
 
-		vector<string> keyval = tokenize(item.c_str(), key_delimiter);
-		string ky  = keyval[0];
-		string val = keyval[1];
-		//add to the parsemap
-		trdmap.insert(pair<string, string>(ky, val));
-	}
-	return true;
-}
+void fork_shard_backends();
 
+void shard_route_interest(const string & key, bool add);
 
+void shard_backend_down(int shard);
 
-//Parse subscription data into a map of values
-bool parse_subscription (string line, map<string, string> & subscmap) {
+void shard_flush_interest(int shard);
 
-	string delchars = "{} \"";
-	for (char c: delchars) {
-		line.erase( remove(line.begin(), line.end(), c), line.end());
-	}
+bool shard_match_interest(const string & sym);
 
-	char item_delimiter = ',';
-	char key_delimiter  = ':';
-	vector<string> items;
-	items = tokenize(line.c_str(), item_delimiter);
+bool shard_read_interest();
 
-	for (string item : items) {
+bool shard_interested(const char *sym);
 
-		vector<string> keyval = tokenize(item.c_str(), key_delimiter);
-		string ky  = keyval[0];
-		string val = keyval[1];
-		//add to the subscribers map
-		subscmap.insert(pair<string, string>(ky, val));
-	}
-	return true;
-}
+size_t fsm_fire_packets(FSMState & fsm, const tradepacket * batch, size_t count);
 
+void fsm_send(FSMState & fsm, const BarMsg & barmsg);
 
+void footprint_add(Footprint & fp, double price, double qty);
 
-//Tokenizing function
-vector<string> tokenize(const char *str, char c)
-{
-    vector<string> result;
+void footprint_widen(Footprint & fp, bool down);
 
-    do
-    {
-        const char *begin = str;
+void footprint_reset(Footprint & fp);
 
-        while(*str != c && *str)
-            str++;
+void fsm_emit_footprint(const SymbolCntxt & symcntxt, Bar_Type bt, string *out = NULL);
 
-        result.push_back(string(begin, str));
-    } while (0 != *str++);
+void fsm_flush_footprints(FSMState & fsm);
 
-    return result;
-}
+size_t bar_msg_size(Bar_Type type);
 
+void deliver_trade(const tradepacket & tp);
 
+void shard_forward_tick();
 
+void build_shard_groups();
 
-//Thread 2: FSM thread. Reads trade packets from Worker 1 and calculates bar OHLC values
-void *fsm_thread_bar_calc(void *msg)
-{
-	struct pollfd fds[1];
-	fds[0].fd = pfd_w1_w2[0];
-	fds[0].events = POLLIN;
-	tradepacket tp;
+size_t symbol_shard(const char *sym, size_t nshards);
 
-	//set fsm_curr_state to FSM_READY
-	fsm_curr_state = FSM_READY;
+void shard_send(FSMShard & shard, const tradepacket & tp);
 
-	while(1) {
-		int timeout_msecs = 60 * 1000;
-		int ret = poll(fds, 1, timeout_msecs);
+void *fsm_thread_batch(void *msg);
 
-		if (ret > 0) {
-			if (fds[0].revents & POLLIN) {
+bool bar_writer_open(BarWriter & writer, int fd, Batch_Format format);
 
-				if ( fcntl( fds[0].fd, F_SETFL, fcntl(fds[0].fd, F_GETFL) | O_NONBLOCK ) < 0 ) {
-					LOG(INFO)  << "Worker 2 (FSM Thread) => Error setting nonblocking flag for incoming data pipe" << endl;
-					cout        << "Worker 2 (FSM Thread) => Error setting nonblocking flag for incoming data pipe" << endl;
-					exit(0);
-				}
+void bar_writer_add(BarWriter & writer, const BarMsg & barmsg);
 
-				int r;
-				while( (r = read(fds[0].fd, &tp, sizeof(tp))) > 0)  {
-					char symbol[15];
-					strcpy(symbol, tp.sym);
-					double price = tp.price;
-					double qty   = tp.qty;
-					uint64_t ts2 = tp.ts2; 
-
-					LOG(INFO)  << "FSM Thread => read tradepacket : sym = " << symbol << ", P = " << price << ", Q = " << qty << ", TS2 = " << ts2 << endl;
-					//Create a trade packet arrival event and fire it
-
-					FSM_EVENT fsm_ev;
-					fsm_ev.type = TRADE_PKT_ARRIVAL;
-					strcpy(fsm_ev.data.trd_pkt.sym, symbol);
-					fsm_ev.data.trd_pkt.price = price;
-					fsm_ev.data.trd_pkt.qty = qty;
-					fsm_ev.data.trd_pkt.ts2 = ts2;
-					fsm_fire_event(fsm_ev);
-				}
-			}
+void bar_writer_flush(BarWriter & writer);
+
+bool shm_bar_table_create(const char *name);
+
+void shm_bar_table_update(const BarMsg & barmsg);
+
+vector<string> tokenize(const char *str, char c);
+
+bool parse_trade(string line, map<string, string> & trdmap);
+
+bool parse_subscription (const char *data, SubscriptionRequest & req);
+
+bool is_symbol_pattern(const string & sym);
+
+SymbolPattern compile_symbol_pattern(const string & glob);
+
+bool symbol_pattern_match(const SymbolPattern & pat, const string & sym);
+
+
+
+// Pipes for IPC between threads
+int pfd_w1_w2[2];  
+int pfd_w2_w3[2];
+
+//Publisher cache
+map<string, BarCntxt> pubs_bar_cache;
+
+//Symbols with no trades for this long (nanoseconds) are evicted from the bar cache by the timer expiry sweep. 0 disables the TTL
+uint64_t fsm_symbol_ttl = 0;
+
+//Max number of symbols in the bar cache. A new symbol beyond it evicts one that has not traded lately (clock algorithm). 0 is no limit
+size_t fsm_max_symbols = 0;
+
+//Max number of symbols in the spill cache. Beyond it the oldest evicted symbols are forgotten and start over if they trade again.
+//0 is no limit
+size_t fsm_max_spilled = 1000000;
+
+//Interval of the bar cache reports of the FSM thread
+const int fsm_stats_interval_secs = 60;
+
+//Trades older than the newest merged trade by up to this window are put back in TS2 order. 0 disables reordering
+uint64_t trade_reorder_window = 0;
+
+//Threads decompressing the blocks of a compressed trade file in parallel
+unsigned int decompress_threads = 1;
+
+//Compressed bytes per parallel decompression task
+const size_t decompress_task_bytes = 1 << 20;
+
+//Max number of bars read from the bars pipe per iteration of the publisher loop
+const size_t publisher_max_bars = 256;
+
+//Busy poll the bars pipe and the websocket server instead of sleeping in epoll_wait. For latency critical deployments
+bool publisher_busy_poll = false;
+
+//Enable permessage-deflate for the clients that ask for it
+bool publisher_deflate = false;
+
+//Interval of the frame reports of the publisher thread
+const int publisher_stats_interval_secs = 60;
+
+//Fixed point formats of the published numbers (-x). Symbols that match none are written with the shortest round trip digits
+vector<FixedPointFormat> fixed_point_formats;
+
+//Reusable buffer of the message serializer. Big enough for a footprint with all its levels
+const size_t serializer_buf_size = 8192;
+char serializer_buf[serializer_buf_size];
+
+//Shared memory table of the latest bars, written by the publisher thread. NULL when not enabled
+ShmBarTableHeader *shm_bar_table = NULL;
+
+//Symbol slots of the shared memory table (power of 2)
+const uint32_t shm_bar_table_num_slots = 8192;
+
+//time interval between bars in nanoseconds. 
+const uint64_t fifteen_sec_nanosecs = 15 * 1000000000UL ;
+
+//bars start 1 nanosecond after the close of the previous bar
+const uint64_t bar_period_nanosecs = fifteen_sec_nanosecs + 1;
+
+//runs of at least this many empty bars are emitted as one EMPTY_BARS_GAP message
+const uint64_t fsm_min_gap_bars = 2;
+
+//Synthetic instruments and the dependency graph: constituent symbol -> indexes of the synthetics derived from it
+vector<SyntheticInstrument> synthetics;
+map<string, vector<int> >   synthetic_dependents;
+
+//Clock source of the FSM
+FSM_Clock fsm_clock = { FSM_CLOCK_EVENT_TIME, -1, 0 };
+
+//Batch mode: bars are written to files instead of being published. Empty output path is the live server
+string       batch_output;
+Batch_Format batch_format = BATCH_FORMAT_CSV;
+bool         batch_trade_bars = false;    //write the trade bar updates too, not only the closing bars
+unsigned int batch_shard_count = 1;
+
+//FSM shards of the batch mode and the symbol groups that must go to the same shard (the legs of the synthetics)
+vector<FSMShard>    batch_shards;
+map<string, string> shard_groups;
+
+//Footprints of the bars (-F)
+bool footprints_enabled = false;
+
+//Initial footprint bucket width, relative to the price of the first trade of a symbol
+const double footprint_initial_width = 0.0001;
+
+//Smallest footprint bucket width, relative to the price
+const double footprint_min_width = 0.000001;
+
+//Row group size of the batch mode bar files
+const size_t batch_row_group_rows = 65536;
+
+//Latest TS2 delivered to any FSM shard. The shards get it as a time tick before their next trade
+uint64_t batch_tick_ts = 0;
+
+//CPUs of every pipeline stage (-A). A stage without CPUs is not pinned
+vector<int> stage_cpus[STAGE_COUNT];
+
+//Threads of every stage pinned so far. Thread i of a stage gets CPU i of its list, round robin
+atomic<unsigned int> stage_threads[STAGE_COUNT];
+
+//Spin-then-block wait (-w): the FSM and the publisher poll without sleeping for this long after their last work, then block.
+//0 blocks right away
+uint64_t spin_wait_usecs = 0;
+
+//Sharded mode (-S): backend processes run the trade reader and the FSM on a symbol partition each, the gateway process runs the
+//publisher on the bars of all of them. 0 is the single process server
+unsigned int process_shard_count = 0;
+
+//Partition of this backend process. -1 in the gateway and in the single process server
+int process_shard_index = -1;
+
+//Gateway: the backends, indexed by partition
+vector<ShardBackend> shard_backends;
+
+//Backend: socket the interest of the gateway comes in on. The bars go out on pfd_w2_w3[1], the bars socket
+int shard_control_fd = -1;
+
+//Backend: latest TS2 of the trades of the other partitions, and the latest time delivered to the FSM. The FSM gets a time tick
+//before its next trade, like the FSM shards of the batch mode
+uint64_t shard_tick_ts      = 0;
+uint64_t shard_sent_tick_ts = 0;
+
+//Backend: trade bars and footprint updates go to the gateway only for the symbols it has subscribers for. Closing bars always go
+//out. Off with -M, the shared memory table of the gateway wants every bar
+bool shard_filter_updates = false;
+
+//Backend: interest of the gateway (key -> adds not removed yet) and its resolution for the symbols seen by the FSM
+map<string, unsigned int>  shard_interest_keys;
+vector<SymbolPattern>      shard_interest_patterns;
+map<string, bool>          shard_interest_cache;
+
+
+
+//FSM Handler Table - resolved at compile time for every (state, event) pair so that the handlers can be inlined.
+//Pairs without a specialization fail to compile instead of dispatching thru a null pointer
+template <FSM_States S, FSM_Event_Types E> struct FSM_Ev_Handler;
+
+template <FSM_Event_Types E> struct FSM_Ev_Handler<FSM_STARTING, E> {
+	static inline bool handle(FSMState & fsm, const typename FSM_Event_Payload<E>::type &) { return process_fsm_starting(fsm); }
+};
+
+template <> struct FSM_Ev_Handler<FSM_READY, TRADE_PKT_ARRIVAL> {
+	static inline bool handle(FSMState & fsm, const FSM_Event_Data_Trade_Pkt & ev_data) { return process_fsm_ready_ev_trd_pkt_arrival(fsm, ev_data); }
+};
+
+template <> struct FSM_Ev_Handler<FSM_READY, TIMER_EXPIRY> {
+	static inline bool handle(FSMState & fsm, const FSM_Event_Data_Timer_Exp & ev_data) { return process_fsm_ready_ev_tmr_expiry(fsm, ev_data); }
+};
+
+template <FSM_Event_Types E> struct FSM_Ev_Handler<FSM_DOWN, E> {
+	static inline bool handle(FSMState & fsm, const typename FSM_Event_Payload<E>::type &) { return process_fsm_down(fsm); }
+};
+
+
+//Process a batch of events with the handler of state S for as long as the FSM stays in state S. Returns the number of events processed
+template <FSM_States S, FSM_Event_Types E>
+inline size_t fsm_run_batch(FSMState & fsm, const typename FSM_Event_Payload<E>::type * evs, size_t n) {
+	size_t i = 0;
+	while ( i < n and fsm.curr_state == S ) {
+		FSM_Ev_Handler<S, E>::handle(fsm, evs[i]);
+		i++;
+	}
+return i;
+}
+
+
+//Fire a batch of FSM events of the same type - Demultiplex based on the fsm.curr_state once per batch instead of once per event
+template <FSM_Event_Types E>
+bool fsm_fire_events(FSMState & fsm, const typename FSM_Event_Payload<E>::type * evs, size_t n) {
+	size_t done = 0;
+	while (done < n) {
+		switch (fsm.curr_state) {
+			case FSM_STARTING : done += fsm_run_batch<FSM_STARTING, E>(fsm, evs + done, n - done); break;
+			case FSM_READY    : done += fsm_run_batch<FSM_READY,    E>(fsm, evs + done, n - done); break;
+			case FSM_DOWN     : done += fsm_run_batch<FSM_DOWN,     E>(fsm, evs + done, n - done); break;
+			default           : return false;
+		}
+	}
+return true;
+}
+
+
+
+
+//MAIN PROGRAM
+int main( int argc, char* argv[] )
+{
+
+    bool help  = false;
+    bool debug = false;
+    decompress_threads = max(1U, thread::hardware_concurrency());
+    unsigned long bench_trades = 0;
+    batch_shard_count = max(1U, thread::hardware_concurrency());
+
+	vector<string> tradefiles;
+
+	const char *synthfile = NULL;
+
+	const char *shm_name = NULL;
+
+	const char *fixedfile = NULL;
+
+	const char *affinity = NULL;
+
+	int c;
+
+    while ( (c = getopt(argc, argv, "f:l:j:b:s:t:m:k:c:o:O:n:M:x:S:A:w:Fzupdh")) != -1) {
+        switch(c)
+        {
+            case 'f' :
+                tradefiles.push_back(optarg);
+                break;
+            case 'j' :
+                decompress_threads = max(1, atoi(optarg));
+                break;
+            case 'l' :
+                trade_reorder_window = strtoull(optarg, NULL, 10) * 1000000UL;
+                break;
+            case 'b' :
+                bench_trades = strtoul(optarg, NULL, 10);
+                break;
+            case 's' :
+                synthfile = optarg;
+                break;
+            case 't' :
+                fsm_symbol_ttl = strtoull(optarg, NULL, 10) * 1000000000UL;
+                break;
+            case 'm' :
+                fsm_max_symbols = strtoul(optarg, NULL, 10);
+                break;
+            case 'k' :
+                fsm_max_spilled = strtoul(optarg, NULL, 10);
+                break;
+            case 'c' :
+                if (strcmp(optarg, "wall") == 0) {
+                    fsm_clock.type = FSM_CLOCK_WALL_TIME;
+                } else if (strcmp(optarg, "event") != 0) {
+                    help = true;
+                }
+                break;
+            case 'p' :
+                publisher_busy_poll = true;
+                break;
+            case 'o' :
+                batch_output = optarg;
+                break;
+            case 'O' :
+                if (strcmp(optarg, "bin") == 0) {
+                    batch_format = BATCH_FORMAT_BIN;
+                } else if (strcmp(optarg, "csv") != 0) {
+                    help = true;
+                }
+                break;
+            case 'n' :
+                batch_shard_count = max(1, atoi(optarg));
+                break;
+            case 'u' :
+                batch_trade_bars = true;
+                break;
+            case 'M' :
+                shm_name = optarg;
+                break;
+            case 'F' :
+                footprints_enabled = true;
+                break;
+            case 'z' :
+                publisher_deflate = true;
+                break;
+            case 'x' :
+                fixedfile = optarg;
+                break;
+            case 'S' :
+                process_shard_count = max(0, atoi(optarg));
+                break;
+            case 'A' :
+                affinity = optarg;
+                break;
+            case 'w' :
+                spin_wait_usecs = strtoull(optarg, NULL, 10);
+                break;
+            case 'd' :
+                debug = true;
+                break;
+            case 'h' :
+                help = true;
+                break;
+        }
+    }
+
+	//if help requested, display and exit
+    if (help) {
+        usage(argc, argv);
+        exit(0);
+    }
+
+
+	//the batch mode and the benchmarks run in one process
+	if ( process_shard_count > 0 and ( !batch_output.empty() or bench_trades > 0 ) ) {
+		cout << "Sharded mode (-S) does not run with the batch mode (-o) or the benchmarks (-b). Use -n to shard the batch mode" << endl;
+		exit(1);
+	}
+
+	//sharded mode: fork the backends before the logger and the threads exist. Every process logs to its own file
+	string log_prefix(argv[0]);
+	if (process_shard_count > 0) {
+		fork_shard_backends();
+		if (process_shard_index >= 0) {
+			log_prefix += ".shard" + to_string(process_shard_index);
+
+			//every backend decompresses the whole input. They share the decompression threads
+			decompress_threads = max(1U, decompress_threads / process_shard_count);
+		}
+	}
+
+	//Initialize the g2log logger
+	g2LogWorker g2log(log_prefix, "./");
+	g2::initializeLogging(&g2log);
+
+	cout      << ".................ANLALYTICAL SERVER (OHLC 15 SECONDS)...................." << endl;
+	LOG(INFO) << ".................ANLALYTICAL SERVER (OHLC 15 SECONDS)...................." << endl;
+
+	//load the synthetic instruments before the FSM starts
+	if (synthfile != NULL and !load_synthetics(synthfile)) {
+		cout      << "Error loading synthetic instruments from : " << synthfile << endl;
+		LOG(INFO) << "Error loading synthetic instruments from : " << synthfile << endl;
+		exit(1);
+	}
+
+	if ( affinity != NULL and !load_stage_affinity(affinity) ) {
+		cout      << "Invalid CPU affinity : " << affinity << endl;
+		LOG(INFO) << "Invalid CPU affinity : " << affinity << endl;
+		exit(1);
+	}
+
+	if (process_shard_index >= 0) {
+		shard_stage_cpus();
+	}
+
+	//the backends report their threads in their own logs
+	if (process_shard_index < 0) {
+		report_topology();
+	}
+
+	if (fixedfile != NULL and !load_fixed_point_formats(fixedfile)) {
+		cout      << "Error loading fixed point formats from : " << fixedfile << endl;
+		LOG(INFO) << "Error loading fixed point formats from : " << fixedfile << endl;
+		exit(1);
+	}
+
+	//run the microbenchmarks instead of the server, if requested
+	if (bench_trades > 0) {
+		fsm_benchmark(bench_trades);
+		serializer_benchmark(bench_trades);
+		return 0;
+	}
+
+	if ( tradefiles.empty() ) {
+		tradefiles.push_back("trades.json");
+	}
+
+	for (const string & tradefile : tradefiles) {
+		cout      << "Using trades file : " << tradefile << endl;
+		LOG(INFO) << "Using trades file : " << tradefile << endl;
+	}
+
+	if ( !batch_output.empty() ) {
+		//batch mode replays as fast as possible. Only the event time clock makes sense
+		fsm_clock.type = FSM_CLOCK_EVENT_TIME;
+	}
+
+	cout      << "Using clock : " << FSM_Clock_Type_Name[fsm_clock.type] << endl;
+	LOG(INFO) << "Using clock : " << FSM_Clock_Type_Name[fsm_clock.type] << endl;
+
+	if ( !batch_output.empty() ) {
+		//Batch mode: Worker 1 feeds an FSM per symbol shard, every shard writes its bars to its own file. No publisher
+		build_shard_groups();
+
+		batch_shards.resize(batch_shard_count);
+		for (size_t k = 0; k < batch_shards.size(); k++) {
+			FSMShard & shard = batch_shards[k];
+			shard.path     = (batch_shards.size() == 1) ? batch_output : batch_output + "." + to_string(k);
+			shard.tick_ts  = 0;
+			shard.trades   = 0;
+			shard.npending = 0;
+			pipe(shard.pfd);
+
+			shard.fd = open(shard.path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (shard.fd < 0) {
+				cout      << "Error opening bars file : " << shard.path << endl;
+				LOG(INFO) << "Error opening bars file : " << shard.path << endl;
+				exit(1);
+			}
+		}
+
+		cout      << "Batch mode : writing " << Batch_Format_Name[batch_format] << " bars to " << batch_output 
+		          << ", shards = " << batch_shards.size() << endl;
+		LOG(INFO) << "Batch mode : writing " << Batch_Format_Name[batch_format] << " bars to " << batch_output 
+		          << ", shards = " << batch_shards.size() << endl;
+
+		auto start = chrono::steady_clock::now();
+
+		pthread_t trade_reader;
+		pthread_create(&trade_reader, NULL, trade_data_reader, (void *) &tradefiles);
+		for (FSMShard & shard : batch_shards) {
+			pthread_create(&shard.thread, NULL, fsm_thread_batch, (void *) &shard);
+		}
+
+		pthread_join(trade_reader, NULL);
+
+		uint64_t trades = 0, rows = 0, bytes = 0;
+		for (FSMShard & shard : batch_shards) {
+			pthread_join(shard.thread, NULL);
+			trades += shard.trades;
+			rows   += shard.writer->total_rows;
+			bytes  += shard.writer->bytes;
+
+			cout      << "Batch mode : " << shard.path << " : trades = " << shard.trades << ", bars = " << shard.writer->total_rows 
+			          << ", bytes = " << shard.writer->bytes << endl;
+			LOG(INFO) << "Batch mode : " << shard.path << " : trades = " << shard.trades << ", bars = " << shard.writer->total_rows 
+			          << ", bytes = " << shard.writer->bytes << endl;
+		}
+
+		double secs = max(chrono::duration<double>(chrono::steady_clock::now() - start).count(), 1e-9);
+
+		stringstream ss;
+		ss << "Batch mode : done. trades = " << trades << ", bars = " << rows << ", bytes = " << bytes
+		   << ", time = " << secs << " secs, " << (uint64_t) (trades / secs) << " trades/sec, " << (uint64_t) (rows / secs) << " bars/sec" << endl;
+		cout      << ss.str();
+		LOG(INFO) << ss.str();
+
+		return 0;
+	}
+
+	if (process_shard_index >= 0) {
+		//backend process: Worker 1 and Worker 2 on the partition. The bars go to the gateway, no publisher
+		build_shard_groups();
+		shard_filter_updates = (shm_name == NULL);
+
+		cout      << "Shard " << process_shard_index << " of " << process_shard_count << " : backend process " << getpid() 
+		          << ", decompression threads = " << decompress_threads << endl;
+		LOG(INFO) << "Shard " << process_shard_index << " of " << process_shard_count << " : backend process " << getpid() 
+		          << ", decompression threads = " << decompress_threads << endl;
+
+		pthread_t trade_reader;
+		pthread_t fsm_thread;
+
+		pipe(pfd_w1_w2);
+
+		const char *fsm = "FSM Thread";
+		pthread_create(&trade_reader, NULL, trade_data_reader, (void *) &tradefiles);
+		pthread_create(&fsm_thread, NULL, fsm_thread_bar_calc, (void *) fsm);
+
+		pthread_join(trade_reader, NULL);
+		pthread_join(fsm_thread, NULL);
+
+		return 0;
+	}
+
+	if (process_shard_count > 0) {
+		//gateway process: the publisher only. Subscriptions are routed to the backend that owns the symbol
+		build_shard_groups();
+
+		cout      << "Sharded mode : gateway process " << getpid() << ", backends = " << shard_backends.size() << endl;
+		LOG(INFO) << "Sharded mode : gateway process " << getpid() << ", backends = " << shard_backends.size() << endl;
+	}
+
+	//create the shared memory table before the publisher writes into it
+	if ( shm_name != NULL and !shm_bar_table_create(shm_name) ) {
+		cout      << "Error creating shared memory bar table : " << shm_name << endl;
+		LOG(INFO) << "Error creating shared memory bar table : " << shm_name << endl;
+		exit(1);
+	}
+
+	pthread_t trade_reader;
+	pthread_t fsm_thread;
+	pthread_t publisher_thread;
+
+	if (process_shard_count > 0) {
+		const char *publisher = "Publisher Thread";
+		pthread_create(&publisher_thread, NULL, publisher_thread_publish_bars, (void *) publisher);
+		pthread_join(publisher_thread, NULL);
+
+		return 0;
+	}
+
+	//create the pipe for data sharing between worker 1 and worker 2
+	pipe(pfd_w1_w2);
+
+	//create the pipe for data sharing between worker 2 and worker 3
+	pipe(pfd_w2_w3);
+
+
+	int retval_1;
+
+	retval_1 = pthread_create(&trade_reader, NULL, trade_data_reader, (void *) &tradefiles);
+
+	int retval_2;
+	const char *fsm = "FSM Thread";
+	retval_2 = pthread_create(&fsm_thread, NULL, fsm_thread_bar_calc, (void *) fsm);
+
+	int retval_3;
+	const char *publisher = "Publisher Thread";
+	retval_3 = pthread_create(&publisher_thread, NULL, publisher_thread_publish_bars, (void *) publisher);
+
+	pthread_join(trade_reader, NULL);
+	pthread_join(fsm_thread, NULL);
+	pthread_join(publisher_thread, NULL);
+
+	return 0;
+}
+
+
+
+//Usage
+void usage(int argc, char* argv[]) {
+    cout << argv[0] << " -f <filename> [-f <filename>..] -l <msecs> -j <threads> -s <filename> -t <secs> -m <count> -k <count> -c <event|wall> -b <count> -o <filename> -O <csv|bin> -n <shards> -M <name> -x <filename> -S <shards> -A <stage=cpus,..|filename> -w <usecs> -Fzupdh" << endl;
+    cout << "       f - trade filename. Repeat to merge multiple trade files in TS2 order" << endl;
+    cout << "       j - threads decompressing a compressed (gzip / zstd) trade file (default: number of cores)" << endl;
+    cout << "       l - reorder window in milliseconds for out of order trades (default 0, no reordering)" << endl;
+    cout << "       s - synthetic instruments filename" << endl;
+    cout << "       t - evict symbols with no trades for <secs> seconds from the bar cache (default 0, never)" << endl;
+    cout << "       m - max number of symbols in the bar cache. Evicts the least recently traded ones beyond it (default 0, no limit)" << endl;
+    cout << "       k - max number of evicted symbols whose bar sequence is kept to resume it. The oldest are forgotten beyond it" << endl;
+    cout << "           (default 1000000, 0 no limit)" << endl;
+    cout << "       b - run the FSM (<count> synthetic trades) and serializer (<count> messages) microbenchmarks and exit" << endl;
+    cout << "       c - clock closing the bars : event (default, replays. time advances with the trades) or wall (live feeds)" << endl;
+    cout << "       o - batch mode. Write the closing bars to <filename> at EOF speed, without the publisher, and exit" << endl;
+    cout << "       O - batch mode output format : csv (default) or bin (binary columnar)" << endl;
+    cout << "       n - batch mode symbol shards processed in parallel (default: number of cores). Shard k writes <filename>.k" << endl;
+    cout << "       u - batch mode. Write the trade bar updates too" << endl;
+    cout << "       M - publish the latest bars into the shared memory table <name> (e.g. /ohlc_bars) for local readers" << endl;
+    cout << "       S - sharded mode. <shards> backend processes build the bars of a symbol partition each, this process publishes them" << endl;
+    cout << "       A - pin the threads of the pipeline stages (reader, source, decompress, fsm, publisher) to CPUs. e.g. fsm=2,publisher=3" << endl;
+    cout << "           or a filename with a <stage> <cpu list> line per stage" << endl;
+    cout << "       w - spin for <usecs> microseconds after the last work before the FSM and the publisher block (default 0)" << endl;
+    cout << "       F - publish the footprint (volume at price, buy / sell) of the bars" << endl;
+    cout << "       x - fixed point formats (decimals of the prices and volumes) of the published symbols filename" << endl;
+    cout << "       z - permessage-deflate compression for the websocket clients that offer it" << endl;
+    cout << "       p - busy poll the bars pipe and the websocket server (lowest latency, burns a core)" << endl;
+    cout << "       d - print debug" << endl;
+    cout << "       h - help" << endl;
+}
+
+
+
+//Thread 1: Merge the trade sources in TS2 order and deliver the trade packets to FSM
+//Every source is read by its own thread. The heads of the sources are merged with a min heap on TS2 (k-way merge), then pass thru
+//a reorder window that puts slightly out of order trades back in order before they reach the bars
+void *trade_data_reader(void *msg) {
+
+	vector<string> *tradefiles = static_cast<vector<string>*>(msg);
+
+	stage_thread_start(STAGE_READER, "reader");
+
+	//start the source readers. They parse ahead while we wait for the subscriptions
+	vector<TradeSource> sources(tradefiles->size());
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		sources[i].path   = (*tradefiles)[i];
+		sources[i].trades = 0;
+		sources[i].ticks  = 0;
+		sources[i].rejected = 0;
+		sources[i].compression = COMPRESSION_NONE;
+		pipe(sources[i].pfd);
+		pthread_create(&sources[i].thread, NULL, trade_source_reader, (void *) &sources[i]);
+	}
+
+	//no clients to wait for in batch mode
+	if ( batch_shards.empty() ) {
+		cout      << "Will wait for " << pre_publish_wait_secs << " seconds for you to establish the client subscriptions" << endl;
+		LOG(INFO) << "Will wait for " << pre_publish_wait_secs << " seconds for you to establish the client subscriptions" << endl;
+
+		for ( int i = 0; i <= pre_publish_wait_secs; i++ ) {
+			cout << "..";
+			sleep(1);
+		}
+	}
+
+	//merge heap of (TS2, source index). Ties go to the source given first
+	typedef pair<uint64_t, size_t> MergeEntry;
+	priority_queue< MergeEntry, vector<MergeEntry>, greater<MergeEntry> > merge_heap;
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		if ( read_tradepacket(sources[i].pfd[0], sources[i].head) ) {
+			merge_heap.push( MergeEntry(sources[i].head.ts2, i) );
+		}
+	}
+
+	//reorder window heap of trades ordered by (TS2, arrival sequence). The sequence keeps trades with the same TS2 in arrival order
+	priority_queue< ReorderEntry, vector<ReorderEntry>, greater<ReorderEntry> > reorder_heap;
+	uint64_t reorder_seq = 0;
+
+	TradeMergeStats stats = { 0, 0, 0, 0, 0 };
+	uint64_t newest_ts2   = 0;
+	uint64_t released_ts2 = 0;
+
+	while ( !merge_heap.empty() or !reorder_heap.empty() ) {
+
+		if ( !merge_heap.empty() ) {
+			size_t src = merge_heap.top().second;
+			merge_heap.pop();
+
+			tradepacket tp = sources[src].head;
+
+			//time ticks of the other backends go thru the merge and the reorder window like the trades, but are not trades
+			bool tick = (tp.sym[0] == '\0');
+			if (tick) {
+				sources[src].ticks++;
+				stats.ticks++;
+			}
+			else {
+				sources[src].trades++;
+				stats.merged++;
+			}
+
+			//refill the heap with the next trade of the same source
+			if ( read_tradepacket(sources[src].pfd[0], sources[src].head) ) {
+				merge_heap.push( MergeEntry(sources[src].head.ts2, src) );
+			}
+
+			bool late = (tp.ts2 < newest_ts2);
+			if (late and !tick) {
+				stats.late++;
+				LOG(INFO)  << "Worker 1 (Trade Reader) => late trade : sym = " << tp.sym << ", TS2 = " << tp.ts2 << ", newest TS2 = " << newest_ts2 << endl;
+			}
+			newest_ts2 = max(newest_ts2, tp.ts2);
+
+			if (trade_reorder_window == 0) {
+				//no reordering. deliver in merge order
+				deliver_trade(tp);
+				continue;
+			}
+
+			if (tp.ts2 < released_ts2 or tp.ts2 + trade_reorder_window < newest_ts2) {
+				//later than the reorder window. It would go into the wrong bar. A late tick is just behind the time already delivered
+				if (!tick) {
+					stats.dropped++;
+					LOG(INFO)  << "Worker 1 (Trade Reader) => dropped trade older than the reorder window : sym = " << tp.sym << ", TS2 = " << tp.ts2 << endl;
+				}
+				continue;
+			}
+
+			if (late and !tick) {
+				stats.reordered++;
+			}
+
+			ReorderEntry entry;
+			entry.seq = reorder_seq++;
+			entry.tp  = tp;
+			reorder_heap.push(entry);
+		}
+
+		//release the trades that are older than the reorder window. Release everything once the sources are done
+		while ( !reorder_heap.empty() and
+		        ( merge_heap.empty() or reorder_heap.top().tp.ts2 + trade_reorder_window <= newest_ts2 ) ) {
+			const tradepacket & rtp = reorder_heap.top().tp;
+			released_ts2 = rtp.ts2;
+			deliver_trade(rtp);
+			reorder_heap.pop();
+		}
+	}
+
+	for (size_t i = 0; i < sources.size(); i++) {
+		pthread_join(sources[i].thread, NULL);
+		close(sources[i].pfd[0]);
+
+		stringstream ss;
+		ss << "Worker 1 (Trade Reader) => source " << sources[i].path << " : trades = " << sources[i].trades;
+
+		if (sources[i].ticks > 0) {
+			ss << ", time ticks = " << sources[i].ticks;
+		}
+
+		if (sources[i].rejected > 0) {
+			ss << ", rejected lines = " << sources[i].rejected;
+		}
+
+		if (sources[i].compression != COMPRESSION_NONE) {
+			double secs = max(sources[i].decompress_secs, 1e-9);
+			ss << ", " << Compression_Type_Name[sources[i].compression]
+			   << " " << sources[i].compressed_bytes / 1048576.0 << " MB -> " << sources[i].decompressed_bytes / 1048576.0 << " MB"
+			   << ", decompress time = " << secs << " secs (" << sources[i].decompressed_bytes / 1048576.0 / secs << " MB/s per thread)"
+			   << ", blocks = " << sources[i].decompress_tasks
+			   << ", wall time = " << sources[i].decompress_wall_secs << " secs";
+			if (sources[i].decompress_failed) {
+				ss << ", DECOMPRESSION FAILED : the trades after the bad block are missing";
+			}
+		}
+		ss << endl;
+
+		cout      << ss.str();
+		LOG(INFO) << ss.str();
+	}
+
+	stringstream ss;
+	ss << "Worker 1 (Trade Reader) => end of trade sources. merged = " << stats.merged;
+	if (stats.ticks > 0) {
+		ss << ", time ticks = " << stats.ticks;
+	}
+	ss << ", late = "      << stats.late
+	   << ", reordered = " << stats.reordered
+	   << ", dropped = "   << stats.dropped
+	   << ", reorder window (ms) = " << trade_reorder_window / 1000000UL << endl;
+
+	cout      << ss.str();
+	LOG(INFO) << ss.str();
+
+	//batch mode: bring every shard up to the time of the last trade and signal EOF
+	for (FSMShard & shard : batch_shards) {
+		if (batch_tick_ts > shard.tick_ts) {
+			tradepacket tick;
+			memset(&tick, 0, sizeof(tick));
+			tick.ts2 = batch_tick_ts;
+			shard_send(shard, tick);
+		}
+		write_all(shard.pfd[1], (const char *) shard.pending, shard.npending * sizeof(tradepacket));
+		close(shard.pfd[1]);
+	}
+
+	//sharded mode: bring the FSM of the backend up to the time of the last trade of all the partitions
+	if (process_shard_index >= 0) {
+		shard_forward_tick();
+	}
+
+return NULL;
+}
+
+
+
+//Backend of the sharded mode: send the FSM a time tick for the trades of the other partitions since its last packet. The wall
+//clock closes the bars by itself, so there is no tick with it
+void shard_forward_tick() {
+
+	if (shard_tick_ts <= shard_sent_tick_ts or fsm_clock.type != FSM_CLOCK_EVENT_TIME) {
+		return;
+	}
+
+	tradepacket tick;
+	memset(&tick, 0, sizeof(tick));
+	tick.ts2 = shard_tick_ts;
+	write(pfd_w1_w2[1], &tick, sizeof(tick));
+	shard_sent_tick_ts = shard_tick_ts;
+}
+
+
+
+//Deliver a merged trade to the FSM. In batch mode the trade goes to the FSM shard of its symbol. Every trade of the live server
+//fires a timer expiry for all the symbols, so a shard first gets a time tick (a packet without a symbol) for the trades that went
+//to the other shards since its last packet. That closes its bars exactly like the live server does
+//A backend of the sharded mode gets the trades of the other partitions as time ticks from the source readers, and does the same
+//with its FSM. The wall clock closes the bars by itself, so the ticks are dropped with it
+void deliver_trade(const tradepacket & tp) {
+
+	if (process_shard_index >= 0) {
+		if (tp.sym[0] == '\0') {
+			shard_tick_ts = max(shard_tick_ts, tp.ts2);
+			return;
+		}
+
+		shard_forward_tick();
+		write(pfd_w1_w2[1], &tp, sizeof(tp));
+
+		shard_tick_ts      = max(shard_tick_ts, tp.ts2);
+		shard_sent_tick_ts = shard_tick_ts;
+		return;
+	}
+
+	if ( batch_shards.empty() ) {
+		write(pfd_w1_w2[1], &tp, sizeof(tp));
+		return;
+	}
+
+	FSMShard & shard = batch_shards[ symbol_shard(tp.sym, batch_shards.size()) ];
+
+	if (batch_tick_ts > shard.tick_ts) {
+		tradepacket tick;
+		memset(&tick, 0, sizeof(tick));
+		tick.ts2 = batch_tick_ts;
+		shard_send(shard, tick);
+	}
+
+	shard_send(shard, tp);
+
+	//expiries only ever move the bars forward, the latest time is all the shards need
+	batch_tick_ts = max(batch_tick_ts, tp.ts2);
+	shard.tick_ts = batch_tick_ts;
+}
+
+
+
+//Buffer a packet for a shard. The packets go down the pipe a batch at a time
+void shard_send(FSMShard & shard, const tradepacket & tp) {
+
+	shard.pending[shard.npending++] = tp;
+	shard.tick_ts = max(shard.tick_ts, tp.ts2);
+
+	if ( shard.npending == sizeof(shard.pending) / sizeof(tradepacket) ) {
+		write_all(shard.pfd[1], (const char *) shard.pending, sizeof(shard.pending));
+		shard.npending = 0;
+	}
+}
+
+
+
+//Group the legs of every synthetic with the synthetic, so that they are processed by the same shard
+void build_shard_groups() {
+
+	for (const SyntheticInstrument & synth : synthetics) {
+		auto group = [](const string & sym) -> string {
+			auto it = shard_groups.find(sym);
+			return (it == shard_groups.end()) ? sym : it->second;
+		};
+
+		string root = group(synth.legs[0]);
+
+		vector<string> members(synth.legs.begin(), synth.legs.end());
+		members.push_back(synth.sym);
+
+		for (const string & member : members) {
+			string old = group(member);
+			if (old != root) {
+				//merge the group of the member into the group of the first leg
+				for (auto & entry : shard_groups) {
+					if (entry.second == old) {
+						entry.second = root;
+					}
+				}
+			}
+			shard_groups[member] = root;
+		}
+	}
+}
+
+
+
+//Shard of a symbol : FNV-1a hash of the symbol, or of its synthetic group
+size_t symbol_shard(const char *sym, size_t nshards) {
+
+	if (nshards == 1) {
+		return 0;
+	}
+
+	string key(sym);
+	if ( !shard_groups.empty() ) {
+		auto it = shard_groups.find(key);
+		if ( it != shard_groups.end() ) {
+			key = it->second;
+		}
+	}
+
+	uint64_t hash = 14695981039346656037UL;
+	for (char c : key) {
+		hash = (hash ^ (unsigned char) c) * 1099511628211UL;
+	}
+return hash % nshards;
+}
+
+
+
+//Source reader thread: Read the trade data of one source, format trade packets and deliver to the merger
+void *trade_source_reader(void *msg) {
+
+	TradeSource *source = static_cast<TradeSource*>(msg);
+
+	stage_thread_start(STAGE_SOURCE, "source");
+
+	//open the trades file. compressed files are read thru their decompressor
+	FILE *trdfile = open_trade_source(*source);
+
+	if ( trdfile == NULL ) {
+		cout      << "Worker 1 (Trade Reader) => Error opening trades file : " << source->path << endl;
+		LOG(INFO) << "Worker 1 (Trade Reader) => Error opening trades file : " << source->path << endl;
+		close(source->pfd[1]);
+		return NULL;
+	}
+
+	char *linebuf = NULL;
+	size_t linebuf_size = 0;
+	ssize_t len;
+
+	while( (len = ::getline(&linebuf, &linebuf_size, trdfile)) > 0 ) {
+
+		//sharded mode: a trade of another partition only moves the time forward. It is not parsed, just its TS2
+		if (process_shard_index >= 0) {
+			tradepacket tick;
+			if ( !trade_line_owned(linebuf, tick) ) {
+				write(source->pfd[1], &tick, sizeof(tick));
+				continue;
+			}
+		}
+
+		string line(linebuf, (linebuf[len - 1] == '\n') ? len - 1 : len);
+		LOG(INFO) << "Read line: " << line << endl;
+		string delchars = "{} \"";
+		for (char c: delchars) {
+			line.erase( remove(line.begin(), line.end(), c), line.end());
+		}
+		LOG(INFO)  << "Worker 1 (Trade Reader) => read line: " << line << endl;
+
+		map<string, string> trademap;
+		parse_trade(line, trademap);
+
+		string symbol;
+		double price;
+		double qty;
+		uint64_t ts2;
+
+		for (auto itr = trademap.begin(); itr != trademap.end(); itr++) {
+			string key = itr->first;
+			string val = itr->second;
+
+			if (key == "sym") {
+				symbol = val;
+			}
+			else if (key == "P") {
+				istringstream is(val);
+				is>>price;
+			}
+			else if (key == "Q") {
+				istringstream is(val);
+				is>>qty;
+			}
+			else if (key == "TS2") {
+				istringstream is(val);
+				is>>ts2;
+			}
+		}
+		
+		LOG(INFO)  << "Worker 1( Trade Reader) => parsed trade: " << "sym = " << symbol << ", P = " << price << ", Q = " << qty << ", TS2 = " << ts2 << endl;
+
+		//a packet without a symbol is a time tick for the FSM. Such a line must not pass for one
+		if ( symbol.empty() or symbol.size() >= sizeof(tradepacket::sym) ) {
+			LOG(INFO)  << "Worker 1 (Trade Reader) => Rejecting trade without a valid symbol : " << line << endl;
+			source->rejected++;
+			continue;
+		}
+
+		//Create trade packet and deliver
+		tradepacket tp;
+		strcpy(tp.sym, symbol.c_str());
+		tp.price = price;
+		tp.qty   = qty;
+		tp.ts2   = ts2;
+
+		//write into the pipe that takes the data to the merger
+		write(source->pfd[1], &tp, sizeof(tp));
+	}
+
+	free(linebuf);
+	fclose(trdfile);
+
+	if (source->compression != COMPRESSION_NONE) {
+		pthread_join(source->decompressor, NULL);
+	}
+
+	//end of source
+	close(source->pfd[1]);
+
+return NULL;
+}
+
+
+
+//Read one trade packet from a source pipe. Returns false at the end of the source
+bool read_tradepacket(int fd, tradepacket & tp) {
+	return read_all(fd, (char *) &tp, sizeof(tp));
+}
+
+
+
+//Read exactly len bytes from fd. Returns false at EOF or on an error
+bool read_all(int fd, char *buf, size_t len) {
+	size_t got = 0;
+	while (got < len) {
+		ssize_t r = read(fd, buf + got, len - got);
+		if (r <= 0) {
+			return false;
+		}
+		got += r;
+	}
+return true;
+}
+
+
+
+//Value of the "key": value field of a raw trade line, without the quotes. key includes its quotes. A quick scan for the trades
+//the sharded mode does not parse
+bool trade_line_field(const char *line, const char *key, string & val) {
+
+	const char *p = strstr(line, key);
+	if (p == NULL) {
+		return false;
+	}
+	p += strlen(key);
+
+	while (*p == ' ' or *p == ':' or *p == '"') {
+		p++;
+	}
+
+	const char *end = p;
+	while (*end != '\0' and *end != '"' and *end != ',' and *end != '}' and *end != ' ' and *end != '\n') {
+		end++;
+	}
+
+	val.assign(p, end - p);
+return !val.empty();
+}
+
+
+
+//Sharded mode: whether the trade of a raw line belongs to the partition of this backend. If not, tick is the time tick
+//(no symbol) for its TS2. Lines that can not be scanned are left to the parser
+bool trade_line_owned(const char *line, tradepacket & tick) {
+
+	static thread_local string sym, ts2;
+
+	if ( !trade_line_field(line, "\"sym\"", sym) or sym.size() >= sizeof(tick.sym) or
+	     symbol_shard(sym.c_str(), process_shard_count) == (size_t) process_shard_index ) {
+		return true;
+	}
+
+	if ( !trade_line_field(line, "\"TS2\"", ts2) ) {
+		return true;
+	}
+
+	memset(&tick, 0, sizeof(tick));
+	tick.ts2 = strtoull(ts2.c_str(), NULL, 10);
+return false;
+}
+
+
+
+//Open a trade source for reading lines. The compression is detected from the magic bytes of the file.
+//Compressed files get a decompressor thread and the lines are read from the pipe it decompresses into
+FILE *open_trade_source(TradeSource & source) {
+
+	int fd = open(source.path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	unsigned char magic[4] = { 0, 0, 0, 0 };
+	pread(fd, magic, sizeof(magic), 0);
+
+	if (magic[0] == 0x1f and magic[1] == 0x8b) {
+		source.compression = COMPRESSION_GZIP;
+	} else if (magic[0] == 0x28 and magic[1] == 0xb5 and magic[2] == 0x2f and magic[3] == 0xfd) {
+		source.compression = COMPRESSION_ZSTD;
+	} else {
+		source.compression = COMPRESSION_NONE;
+		return fdopen(fd, "r");
+	}
+
+#ifndef WITH_ZSTD
+	if (source.compression == COMPRESSION_ZSTD) {
+		LOG(INFO) << "Worker 1 (Trade Reader) => zstd trade file but built without zstd support (WITH_ZSTD) : " << source.path << endl;
+		close(fd);
+		return NULL;
+	}
+#endif
+
+	source.compressed_fd      = fd;
+	source.compressed_bytes   = 0;
+	source.decompressed_bytes = 0;
+	source.decompress_tasks   = 0;
+	source.decompress_secs    = 0;
+	source.decompress_wall_secs = 0;
+	source.decompress_failed  = false;
+	pipe(source.dfd);
+	pthread_create(&source.decompressor, NULL, trade_source_decompressor, (void *) &source);
+
+	return fdopen(source.dfd[0], "r");
+}
+
+
+
+//Decompressor thread: Decompress a trade file into the pipe read by the source reader, so that decompression and parsing overlap.
+//Files made of independent blocks (BGZF gzip members, zstd frames) are decompressed in parallel, a window of tasks ahead of the
+//parser, and written to the pipe in file order. Other files are decompressed as one stream
+void *trade_source_decompressor(void *msg) {
+
+	TradeSource *source = static_cast<TradeSource*>(msg);
+	int fd = source->compressed_fd;
+
+	stage_thread_start(STAGE_DECOMPRESS, "decompress");
+
+	struct stat st;
+	fstat(fd, &st);
+	size_t size = st.st_size;
+
+	unsigned char *data = (size > 0) ? (unsigned char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+
+	if (data == MAP_FAILED or data == NULL) {
+		LOG(INFO) << "Worker 1 (Trade Reader) => Error mapping compressed trades file : " << source->path << endl;
+		close(source->dfd[1]);
+		close(fd);
+		return NULL;
+	}
+	madvise(data, size, MADV_SEQUENTIAL);
+
+	auto start = chrono::steady_clock::now();
+
+	vector< pair<size_t, size_t> > blocks = split_compressed_blocks(data, size, source->compression);
+
+	if (blocks.size() <= 1 or decompress_threads == 1) {
+		//not splittable. decompress as one stream straight into the pipe
+		source->decompress_tasks = 1;
+		if ( !decompress_block(data, size, source->compression, source->dfd[1], NULL, source->decompressed_bytes, source->decompress_secs) ) {
+			LOG(INFO) << "Worker 1 (Trade Reader) => Error decompressing trades file : " << source->path << endl;
+			cout      << "Worker 1 (Trade Reader) => Error decompressing trades file : " << source->path << endl;
+			source->decompress_failed = true;
+		}
+	}
+	else {
+		//group the blocks into tasks of decompress_task_bytes, queued to a fixed pool of decompress_threads workers.
+		//Up to two tasks per worker are queued or running ahead of the one written to the pipe.
+		//A bad block stops the source : the tasks not started yet are dropped, the running ones are waited for and dropped
+		DecompressPool pool;
+		pool.data        = data;
+		pool.compression = source->compression;
+		pool.stopping    = false;
+
+		vector<thread> workers;
+		for (unsigned int i = 0; i < decompress_threads; i++) {
+			workers.emplace_back(decompress_worker, &pool);
+		}
+
+		//in file order. push_back / pop_front of a deque keep the queued pointers valid
+		deque<DecompressTask> inflight;
+		size_t b = 0;
+
+		while ( (!source->decompress_failed and b < blocks.size()) or !inflight.empty() ) {
+
+			while ( !source->decompress_failed and b < blocks.size() and inflight.size() < 2 * decompress_threads ) {
+				size_t task_start = blocks[b].first;
+				size_t task_end   = task_start;
+				while ( b < blocks.size() and (task_end == task_start or task_end - task_start < decompress_task_bytes) ) {
+					task_end = blocks[b].first + blocks[b].second;
+					b++;
+				}
+
+				inflight.emplace_back();
+				DecompressTask & task = inflight.back();
+				task.offset    = task_start;
+				task.len       = task_end - task_start;
+				task.busy_secs = 0.0;
+				task.ok        = false;
+				task.finished  = false;
+				{
+					lock_guard<mutex> lk(pool.lock);
+					pool.queue.push_back(&task);
+				}
+				pool.queued.notify_one();
+				source->decompress_tasks++;
+			}
+
+			DecompressTask & task = inflight.front();
+			{
+				unique_lock<mutex> lk(pool.lock);
+				pool.finished.wait(lk, [&task]() { return task.finished; });
+			}
+
+			if (!source->decompress_failed and !task.ok) {
+				//the partial output of the bad block is not delivered. The parser sees the end of the source
+				LOG(INFO) << "Worker 1 (Trade Reader) => Error decompressing the block at offset " << task.offset << " of trades file : " << source->path << endl;
+				cout      << "Worker 1 (Trade Reader) => Error decompressing the block at offset " << task.offset << " of trades file : " << source->path << endl;
+				source->decompress_failed = true;
+
+				//drop the tasks not started yet. They finish without output
+				lock_guard<mutex> lk(pool.lock);
+				for (DecompressTask *queued : pool.queue) {
+					queued->finished = true;
+				}
+				pool.queue.clear();
+			}
+			else if (!source->decompress_failed) {
+				source->decompressed_bytes += task.out.size();
+				source->decompress_secs    += task.busy_secs;
+				write_all(source->dfd[1], task.out.data(), task.out.size());
+			}
+
+			inflight.pop_front();
+		}
+
+		{
+			lock_guard<mutex> lk(pool.lock);
+			pool.stopping = true;
+		}
+		pool.queued.notify_all();
+		for (thread & worker : workers) {
+			worker.join();
+		}
+	}
+
+	source->compressed_bytes     = size;
+	source->decompress_wall_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	munmap(data, size);
+	close(fd);
+
+	//end of the decompressed data
+	close(source->dfd[1]);
+
+return NULL;
+}
+
+
+
+//Split a compressed file into blocks that can be decompressed independently. Returns (offset, length) of each block.
+//gzip members are only splittable when they carry their size (BGZF / bgzip). zstd frames always carry it.
+//Anything else is returned as a single block
+vector< pair<size_t, size_t> > split_compressed_blocks(const unsigned char *data, size_t len, Compression_Type ct) {
+
+	vector< pair<size_t, size_t> > blocks;
+	size_t off = 0;
+
+	while (off < len) {
+		size_t block_len = 0;
+
+		if (ct == COMPRESSION_GZIP) {
+			//BGZF member header : 1f 8b 08 FEXTRA ... XLEN, subfield 'B' 'C' of length 2 holding the member size - 1
+			const unsigned char *h = data + off;
+			if ( len - off >= 18 and h[0] == 0x1f and h[1] == 0x8b and h[2] == 8 and (h[3] & 4) and
+			     h[12] == 'B' and h[13] == 'C' and h[14] == 2 and h[15] == 0 ) {
+				block_len = (h[16] | (h[17] << 8)) + 1;
+			}
+		}
+#ifdef WITH_ZSTD
+		else if (ct == COMPRESSION_ZSTD) {
+			size_t frame_len = ZSTD_findFrameCompressedSize(data + off, len - off);
+			if ( !ZSTD_isError(frame_len) ) {
+				block_len = frame_len;
+			}
+		}
+#endif
+
+		if (block_len == 0 or block_len > len - off) {
+			//not splittable from here on
+			blocks.clear();
+			blocks.push_back( pair<size_t, size_t>(0, len) );
+			return blocks;
+		}
+
+		blocks.push_back( pair<size_t, size_t>(off, block_len) );
+		off += block_len;
+	}
+	return blocks;
+}
+
+
+
+//Decompression worker of a compressed trade file: pinned once, it runs the queued tasks until the pool stops
+void decompress_worker(DecompressPool *pool) {
+
+	stage_thread_start(STAGE_DECOMPRESS, "decompress");
+
+	unique_lock<mutex> lk(pool->lock);
+	while (true) {
+		pool->queued.wait(lk, [pool]() { return pool->stopping or !pool->queue.empty(); });
+		if (pool->queue.empty()) {
+			return;
+		}
+
+		DecompressTask *task = pool->queue.front();
+		pool->queue.pop_front();
+		lk.unlock();
+
+		uint64_t out_bytes = 0;
+		bool ok = decompress_block(pool->data + task->offset, task->len, pool->compression, -1, &task->out, out_bytes, task->busy_secs);
+
+		lk.lock();
+		task->ok       = ok;
+		task->finished = true;
+		pool->finished.notify_all();
+	}
+}
+
+
+
+//Decompress a range of gzip members or zstd frames. The output goes to the fd when out is NULL, otherwise it is appended to out.
+//busy_secs is incremented by the time spent decompressing, not counting the time blocked writing into the fd
+bool decompress_block(const unsigned char *data, size_t len, Compression_Type ct, int fd, string *out, uint64_t & out_bytes, double & busy_secs) {
+
+	const size_t chunk_size = 256 * 1024;
+	vector<char> chunk(chunk_size);
+	bool ok = true;
+
+	auto start = chrono::steady_clock::now();
+	chrono::steady_clock::duration blocked(0);
+
+	//deliver decompressed bytes to the string or the fd
+	auto sink = [&](size_t produced) {
+		out_bytes += produced;
+		if (out != NULL) {
+			out->append(chunk.data(), produced);
+			return true;
+		}
+		auto write_start = chrono::steady_clock::now();
+		bool written = write_all(fd, chunk.data(), produced);
+		blocked += chrono::steady_clock::now() - write_start;
+		return written;
+	};
+
+	if (ct == COMPRESSION_GZIP) {
+		z_stream zs;
+		memset(&zs, 0, sizeof(zs));
+		//15 + 32 : max window, detect the gzip header
+		if (inflateInit2(&zs, 15 + 32) != Z_OK) {
+			return false;
+		}
+
+		size_t consumed = 0;
+		while (ok) {
+			//avail_in is 32 bits. feed large files in slices
+			if (zs.avail_in == 0 and consumed < len) {
+				zs.next_in  = (Bytef *) data + consumed;
+				zs.avail_in = (uInt) min(len - consumed, (size_t) 1 << 30);
+				consumed   += zs.avail_in;
+			}
+
+			zs.next_out  = (Bytef *) chunk.data();
+			zs.avail_out = chunk_size;
+			int ret = inflate(&zs, Z_NO_FLUSH);
+			size_t produced = chunk_size - zs.avail_out;
+
+			if (produced > 0) {
+				ok = sink(produced);
+			}
+
+			if (ret == Z_STREAM_END) {
+				//end of a member. more members may follow
+				if (zs.avail_in == 0 and consumed == len) {
+					break;
+				}
+				inflateReset(&zs);
+			} else if (ret != Z_OK and !(ret == Z_BUF_ERROR and produced > 0)) {
+				ok = false;
+			} else if (produced == 0 and zs.avail_in == 0 and consumed == len) {
+				//truncated member
+				ok = false;
+			}
+		}
+		inflateEnd(&zs);
+	}
+#ifdef WITH_ZSTD
+	else if (ct == COMPRESSION_ZSTD) {
+		ZSTD_DStream *zds = ZSTD_createDStream();
+		ZSTD_initDStream(zds);
+
+		//ret is 0 once a frame is complete and flushed, a hint of the input still needed otherwise
+		size_t ret = 1;
+		ZSTD_inBuffer in = { data, len, 0 };
+		while (ok and in.pos < in.size) {
+			ZSTD_outBuffer zout = { chunk.data(), chunk_size, 0 };
+			ret = ZSTD_decompressStream(zds, &zout, &in);
+			if (ZSTD_isError(ret)) {
+				LOG(INFO) << "Worker 1 (Trade Reader) => zstd error : " << ZSTD_getErrorName(ret) << endl;
+				ok = false;
+				break;
+			}
+
+			if (zout.pos > 0) {
+				ok = sink(zout.pos);
+			}
+		}
+
+		//flush what is left in the decoder. No progress with a nonzero return at the end of the input is a truncated frame
+		while (ok and ret != 0) {
+			ZSTD_outBuffer zout = { chunk.data(), chunk_size, 0 };
+			ret = ZSTD_decompressStream(zds, &zout, &in);
+			if (ZSTD_isError(ret)) {
+				LOG(INFO) << "Worker 1 (Trade Reader) => zstd error : " << ZSTD_getErrorName(ret) << endl;
+				ok = false;
+				break;
+			}
+			if (zout.pos == 0) {
+				LOG(INFO) << "Worker 1 (Trade Reader) => zstd frame truncated" << endl;
+				ok = false;
+				break;
+			}
+			ok = sink(zout.pos);
+		}
+		ZSTD_freeDStream(zds);
+	}
+#endif
+	else {
+		ok = false;
+	}
+
+	busy_secs += chrono::duration<double>(chrono::steady_clock::now() - start - blocked).count();
+return ok;
+}
+
+
+
+//Write the whole buffer into a pipe
+bool write_all(int fd, const char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t w = write(fd, buf, len);
+		if (w <= 0) {
+			return false;
+		}
+		buf += w;
+		len -= w;
+	}
+return true;
+}
+
+
+
+//Parse trade data into a map of values
+bool parse_trade(string line, map<string, string> & trdmap) {
+
+	char item_delimiter = ',';
+	char key_delimiter  = ':';
+	vector<string> items;
+	items = tokenize(line.c_str(), item_delimiter);
+
+	for (string item : items) {
+
+		vector<string> keyval = tokenize(item.c_str(), key_delimiter);
+		string ky  = keyval[0];
+		string val = keyval[1];
+		//add to the parsemap
+		trdmap.insert(pair<string, string>(ky, val));
+	}
+	return true;
+}
+
+
+
+//Parse a subscription message. Single pass over the message; values are strings, numbers or arrays of strings
+//	{"event": "subscribe", "symbol": "XETHZUSD", "interval" : "15"}
+//	{"event": "subscribe", "symbol": ["XETHZUSD", "X*ZUSD"], "interval" : "15"}
+bool parse_subscription (const char *data, SubscriptionRequest & req) {
+
+	const char *p = data;
+	string key;
+	string val;
+	bool in_array = false;
+
+	while (*p and *p != '{') p++;
+	if (*p == '\0') {
+		return false;
+	}
+	p++;
+
+	while (*p) {
+		char c = *p;
+
+		if (c == '"' or isalnum((unsigned char) c) or c == '-' or c == '.' or c == '*' or c == '?') {
+			//quoted string or bare token (number, true, false)
+			val.clear();
+			if (c == '"') {
+				p++;
+				while (*p and *p != '"') {
+					if (*p == '\\' and *(p + 1)) p++;
+					val += *p++;
+				}
+				if (*p == '\0') {
+					return false;
+				}
+				p++;
+			} else {
+				while (*p and !isspace((unsigned char) *p) and *p != ',' and *p != '}' and *p != ']' and *p != ':') {
+					val += *p++;
+				}
+			}
+
+			while (*p and isspace((unsigned char) *p)) p++;
+
+			if (!in_array and key.empty() and *p == ':') {
+				key = val;
+				p++;
+				continue;
+			}
+
+			if (key == "event") {
+				req.event = val;
+			} else if (key == "symbol") {
+				req.symbols.push_back(val);
+			} else if (key == "interval") {
+				req.interval = val;
+			}
+
+			if (!in_array) {
+				key.clear();
+			}
+			continue;
+		}
+
+		if (c == '[') {
+			in_array = true;
+		} else if (c == ']') {
+			in_array = false;
+			key.clear();
+		} else if (c == '}') {
+			return true;
+		}
+		p++;
+	}
+	return false;
+}
+
+
+
+//Symbols with * or ? are glob patterns
+bool is_symbol_pattern(const string & sym) {
+	return sym.find_first_of("*?") != string::npos;
+}
+
+
+
+//Compile a glob pattern. Runs of * are collapsed into one
+SymbolPattern compile_symbol_pattern(const string & glob) {
+	SymbolPattern pat;
+	for (char c : glob) {
+		if ( !(c == '*' and !pat.glob.empty() and pat.glob.back() == '*') ) {
+			pat.glob += c;
+		}
+	}
+	pat.prefix    = pat.glob.substr(0, pat.glob.find_first_of("*?"));
+	pat.match_all = (pat.glob == "*");
+	return pat;
+}
+
+
+
+//Match sym against a compiled glob pattern. Backtracks to the last * on a mismatch
+bool symbol_pattern_match(const SymbolPattern & pat, const string & sym) {
+
+	if (pat.match_all) {
+		return true;
+	}
+
+	if (sym.compare(0, pat.prefix.size(), pat.prefix) != 0) {
+		return false;
+	}
+
+	const string & g = pat.glob;
+	size_t si = 0, gi = 0;
+	size_t star = string::npos, mark = 0;
+
+	while (si < sym.size()) {
+		if (gi < g.size() and (g[gi] == '?' or g[gi] == sym[si])) {
+			si++;
+			gi++;
+		} else if (gi < g.size() and g[gi] == '*') {
+			star = gi++;
+			mark = si;
+		} else if (star != string::npos) {
+			gi = star + 1;
+			si = ++mark;
+		} else {
+			return false;
+		}
+	}
+
+	while (gi < g.size() and g[gi] == '*') gi++;
+
+	return gi == g.size();
+}
+
+
+
+//Load the synthetic instruments. One instrument per line, legs separated by * or /. Lines starting with # are comments
+//	XETHZUSD.XBT = XETHXXBT * XXBTZUSD
+//	XXBTXETH.INV = 1 / XETHXXBT
+bool load_synthetics(const char *fname) {
+
+	ifstream synfile(fname);
+	if ( !synfile.is_open() ) {
+		return false;
+	}
+
+	string line;
+	while (getline(synfile, line)) {
+		istringstream is(line);
+		string name, eq, token;
+
+		if ( !(is >> name) or name[0] == '#' ) {
+			continue;
+		}
+
+		SyntheticInstrument synth;
+		if ( !(is >> eq) or eq != "=" or name.size() >= sizeof(synth.sym) ) {
+			LOG(INFO) << "Invalid synthetic instrument definition : " << line << endl;
+			return false;
+		}
+
+		//a synthetic can only be derived from symbols defined before it. that keeps the dependency graph acyclic
+		bool redefined = ( synthetic_dependents.find(name) != synthetic_dependents.end() );
+		for (const SyntheticInstrument & prev : synthetics) {
+			redefined = redefined or (name == prev.sym);
+		}
+		if (redefined) {
+			LOG(INFO) << "Synthetic instrument already defined or used by an earlier synthetic : " << line << endl;
+			return false;
+		}
+		strcpy(synth.sym, name.c_str());
+
+		int exponent = 1;
+		bool expect_leg = true;
+		while (is >> token) {
+			if (expect_leg) {
+				//a leading 1 is the numerator of an inverted leg : 1 / SYM
+				if ( !(token == "1" and synth.legs.empty()) ) {
+					if (token == name) {
+						LOG(INFO) << "Synthetic instrument depends on itself : " << line << endl;
+						return false;
+					}
+					synth.legs.push_back(token);
+					synth.exponents.push_back(exponent);
+				}
+			}
+			else if (token == "*" or token == "/") {
+				exponent = (token == "*") ? 1 : -1;
+			}
+			else {
+				LOG(INFO) << "Invalid synthetic instrument definition : " << line << endl;
+				return false;
+			}
+			expect_leg = !expect_leg;
+		}
+
+		if ( synth.legs.empty() or expect_leg ) {
+			LOG(INFO) << "Invalid synthetic instrument definition : " << line << endl;
+			return false;
+		}
+
+		//register the synthetic with each of its legs in the dependency graph
+		int idx = synthetics.size();
+		synthetics.push_back(synth);
+		for (const string & leg : synth.legs) {
+			vector<int> & deps = synthetic_dependents[leg];
+			if ( find(deps.begin(), deps.end(), idx) == deps.end() ) {
+				deps.push_back(idx);
+			}
+		}
+
+		cout      << "Synthetic instrument : " << line << endl;
+		LOG(INFO) << "Synthetic instrument : " << line << endl;
+	}
+	return true;
+}
+
+
+
+//Tokenizing function
+vector<string> tokenize(const char *str, char c)
+{
+    vector<string> result;
+
+    do
+    {
+        const char *begin = str;
+
+        while(*str != c && *str)
+            str++;
+
+        result.push_back(string(begin, str));
+    } while (0 != *str++);
+
+    return result;
+}
+
+
+
+
+//Thread 2: FSM thread. Reads trade packets from Worker 1 and calculates bar OHLC values
+void *fsm_thread_bar_calc(void *msg)
+{
+	stage_thread_start(STAGE_FSM, "fsm");
+
+	FSMState fsm;
+
+	struct pollfd fds[3];
+	int nfds = 1;
+	fds[0].fd = pfd_w1_w2[0];
+	fds[0].events = POLLIN;
+
+	//the wall clock timer closes the bars when their close time is reached, whether or not trades arrive
+	if ( !fsm_clock_init() ) {
+		LOG(INFO)  << "Worker 2 (FSM Thread) => Error creating the clock timer" << endl;
+		cout       << "Worker 2 (FSM Thread) => Error creating the clock timer" << endl;
+		exit(0);
+	}
+
+	int timer_idx = -1;
+	if (fsm_clock.timer_fd >= 0) {
+		timer_idx = nfds++;
+		fds[timer_idx].fd = fsm_clock.timer_fd;
+		fds[timer_idx].events = POLLIN;
+	}
+
+	//backend of the sharded mode: the gateway tells which symbols have subscribers
+	int control_idx = -1;
+	if (shard_control_fd >= 0) {
+		control_idx = nfds++;
+		fds[control_idx].fd = shard_control_fd;
+		fds[control_idx].events = POLLIN;
+	}
+
+	//trade packets are read from the pipe in batches. carry holds the bytes of a packet split across two reads
+	tradepacket batch[fsm_batch_size];
+	size_t carry = 0;
+
+	if ( fcntl( fds[0].fd, F_SETFL, fcntl(fds[0].fd, F_GETFL) | O_NONBLOCK ) < 0 ) {
+		LOG(INFO)  << "Worker 2 (FSM Thread) => Error setting nonblocking flag for incoming data pipe" << endl;
+		cout        << "Worker 2 (FSM Thread) => Error setting nonblocking flag for incoming data pipe" << endl;
+		exit(0);
+	}
+
+	//set fsm.curr_state to FSM_READY
+	fsm.curr_state = FSM_READY;
+
+	auto next_report = chrono::steady_clock::now() + chrono::seconds(fsm_stats_interval_secs);
+	auto last_work   = chrono::steady_clock::now();
+
+	while(1) {
+		//spin-then-block: poll without sleeping for a while after the last work (-w), then block
+		int timeout_msecs = spin_wait(last_work) ? 0 : 60 * 1000;
+		int ret = poll(fds, nfds, timeout_msecs);
+
+		if (ret == 0 and timeout_msecs == 0) {
+			continue;
+		}
+
+		if (ret > 0) {
+			last_work = chrono::steady_clock::now();
+
+			if (timer_idx >= 0 and (fds[timer_idx].revents & POLLIN)) {
+				fsm_clock_tick(fsm);
+			}
+
+			if (control_idx >= 0 and fds[control_idx].revents != 0 and !shard_read_interest()) {
+				//the gateway is gone. Nobody to send the bars to
+				LOG(INFO)  << "Worker 2 (FSM Thread) => Gateway closed the control socket. Exiting" << endl;
+				cout       << "Worker 2 (FSM Thread) => Gateway closed the control socket. Exiting" << endl;
+				exit(0);
+			}
+
+			if (fds[0].revents & POLLIN) {
+
+				ssize_t r;
+				while( (r = read(fds[0].fd, (char *) batch + carry, sizeof(batch) - carry)) > 0)  {
+					size_t bytes = carry + r;
+					size_t count = bytes / sizeof(tradepacket);
+
+					LOG(INFO)  << "FSM Thread => read " << count << " tradepackets. Firing trade packet arrival events" << endl;
+					fsm_fire_packets(fsm, batch, count);
+					fsm_flush_footprints(fsm);
+
+					carry = bytes % sizeof(tradepacket);
+					memmove(batch, (char *) batch + count * sizeof(tradepacket), carry);
+				}
+
+				//new bars may close before the time the clock is armed for
+				fsm_clock_arm(fsm);
+			}
+		}
+		else {
+			LOG(INFO)  << "Worker 2 (FSM Thread) => Timeout occured while reading trade data. No trade data to read from source pipe fd" << endl;
+			cout       << "Worker 2 (FSM Thread) => Timeout occured while reading trade data. No trade data to read from source pipe fd" << endl;
+		}
+
+		if ( chrono::steady_clock::now() >= next_report ) {
+			fsm_report_cache_stats(fsm);
+			next_report = chrono::steady_clock::now() + chrono::seconds(fsm_stats_interval_secs);
+		}
+	}
+}
+
+
+
+//Fire FSM Event
+bool fsm_fire_event(FSMState & fsm, FSM_EVENT & fsm_ev) {
+	switch (fsm_ev.type) {
+		case TRADE_PKT_ARRIVAL : return fsm_fire_events<TRADE_PKT_ARRIVAL>(fsm, &fsm_ev.data.trd_pkt, 1);
+		case TIMER_EXPIRY      : return fsm_fire_events<TIMER_EXPIRY>(fsm, &fsm_ev.data.tmr_exp, 1);
+		default                : return false;
+	}
+}
+
+//Process events while FSM_State == FSM_STARTING. Ignore all events received at this stage
+bool process_fsm_starting(FSMState & fsm) {
+
+	FSM_TRACE  << "Worker 2(FSM Thread) => event arrived. Ignoring as state = " << FSM_State_Name[fsm.curr_state] << endl;
+return true;
+}
+
+//Process events while FSM_State == FSM_DOWN. Ignore all events received at this stage
+bool process_fsm_down(FSMState & fsm) {
+
+	FSM_TRACE  << "Worker 2(FSM Thread) => event arrived. Ignoring as state = " << FSM_State_Name[fsm.curr_state] << endl;
+return true;
+}
+
+
+//Process events TRADE_PKT_ARRIVAL while FSM_State == FSM_READY
+bool process_fsm_ready_ev_trd_pkt_arrival(FSMState & fsm, const FSM_Event_Data_Trade_Pkt & trd_pkt) {
+	
+	const char *symbol = trd_pkt.sym;
+	double price = trd_pkt.price;
+	double qty   = trd_pkt.qty;
+	uint64_t ts2 = trd_pkt.ts2; 
+	uint64_t expired_timestamp = ts2; 
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => event arrived = trd_pkt_arrival: sym = " << symbol << ", P = " << price << ", Q = " << qty << ", TS2 = " << ts2 << endl;
+
+	//check if symbol exists in Bar contexts cache
+	string sym(symbol);
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => Searching bar cache for symbol " << symbol << endl;
+
+	SymbolCntxt *symcntxt = fsm_find_cntxt(fsm, sym);
+
+	bool cntxt_exists = (symcntxt != NULL);
+
+	if (!cntxt_exists) {
+		//bars context does not exist. create it in the cache
+	    FSM_TRACE  << "Worker 2 (FSM Thread) => Bar context does not exist. Creating it : sym = " << symbol << endl;
+		SymbolCntxt & newsymcntxt = fsm_new_cntxt(fsm, sym);
+		newsymcntxt.last_trade_time = ts2;
+		symcntxt = &newsymcntxt;
+
+		BarCntxt & newcntxt = newsymcntxt.bar;
+		strcpy(newcntxt.sym, symbol);
+		newcntxt.bar_num        = 1;
+		newcntxt.bar_start_time = fsm_clock_bar_start(ts2);
+		newcntxt.bar_close_time = newcntxt.bar_start_time + fifteen_sec_nanosecs;
+		newcntxt.bar_open       = price;
+		newcntxt.bar_high       = price;
+		newcntxt.bar_low        = price;
+		newcntxt.bar_close      = price;
+		newcntxt.bar_volume     = qty;
+
+		fsm.next_bar_close_time = min(fsm.next_bar_close_time, newcntxt.bar_close_time);
+
+		//TODO - update subscribers on bar open
+		fsm_emit_bar(fsm, newcntxt, TRADE_BAR);
+	}
+	else {
+		//bars context exist, update it in place
+	    FSM_TRACE  << "Worker 2 (FSM Thread) => Bar context exists. Update it : sym = " << symbol << endl;
+
+		symcntxt->last_trade_time = ts2;
+		symcntxt->referenced      = true;
+
+		BarCntxt & cntxt = symcntxt->bar;
+
+	    FSM_TRACE  << "Worker 2 (FSM Thread) => sym = " << symbol << ", Current bar close time = " << cntxt.bar_close_time << ", Current TS2 : " << ts2 << endl;
+
+		if ( ts2 <= cntxt.bar_close_time) {
+	    FSM_TRACE  << "Worker 2 (FSM Thread) => sym = " << symbol << ". Trade goes into exising bar" << endl;
+
+			//trade goes into existing bar
+			if (price > cntxt.bar_high) {
+				cntxt.bar_high = price;
+			}
+
+			if (price < cntxt.bar_low ) {
+				cntxt.bar_low  = price;
+			}
+
+			cntxt.bar_close    = price;
+			cntxt.bar_volume  += qty;
+		
+		//TODO - update subscribers on trade update
+		fsm_emit_bar(fsm, cntxt, TRADE_BAR);
+		}
+		else {
+			    //trade goes into next bar or someother future bar
+	    		FSM_TRACE  << "Worker 2 (FSM Thread) => sym = " << symbol << ". Trade goes into next bar or future bar" << endl;
+				//close the current bar and jump to the bar that accomodates the current trade
+				fsm_close_bars_until(fsm, *symcntxt, ts2, CLOSING_BAR);
+				
+				//the intermediate bars have been closed. update the current bar with current trade info
+				cntxt.bar_open     = price;
+				cntxt.bar_high     = price;
+				cntxt.bar_low      = price;
+				cntxt.bar_close    = price;
+				cntxt.bar_volume  += qty;
+
+				//TODO - update subscribers on trade update
+				fsm_emit_bar(fsm, cntxt, TRADE_BAR);
+		}
+	}
+
+	//add the trade to the footprint of the bar. The update goes out at the end of the batch
+	Footprint *fp = symcntxt->footprint.get();
+	if ( fp != NULL and qty > 0 ) {
+		footprint_add(*fp, price, qty);
+		if (!fp->dirty) {
+			fp->dirty = true;
+			fsm.dirty_footprints.push_back(symcntxt);
+		}
+	}
+
+	//the price of the symbol changed. recompute the synthetic instruments derived from it
+	if ( !synthetic_dependents.empty() ) {
+		fsm_update_synthetics(fsm, sym, ts2);
+	}
+
+	//Event time clock: Create a timer expiry event for the currently processed UTC timestamp. Let's all progress together, bring others along
+
+	//When we replay existing trades, time is the TS2 of the trades, so there is no system timer to wait for. With the wall clock
+	//(live feeds) the timer expiry events come from the clock timer instead, see fsm_clock_tick()
+
+	//This timer-expiry will hook along the processing in other tickers as well
+	if (fsm_clock.type == FSM_CLOCK_EVENT_TIME) {
+		FSM_Event_Data_Timer_Exp tmr_exp;
+		tmr_exp.ts = expired_timestamp;
+		fsm_fire_events<TIMER_EXPIRY>(fsm, &tmr_exp, 1);
+	}
+
+return true;
+}
+
+
+
+
+//Process events TIMER_EXPIRY while FSM_State == FSM_READY
+bool process_fsm_ready_ev_tmr_expiry(FSMState & fsm, const FSM_Event_Data_Timer_Exp & tmr_exp) {
+	uint64_t expired_ts = tmr_exp.ts; 
+
+	fsm.last_expiry_ts = max(fsm.last_expiry_ts, expired_ts);
+
+	//no bar in the cache closes before fsm.next_bar_close_time. Skip the sweep of the bar cache
+	if (expired_ts <= fsm.next_bar_close_time) {
+		return true;
+	}
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => event arrived = timer_expiry: " << "TS = " << expired_ts << endl;
+
+	uint64_t next_bar_close_time = fsm_close_spilled_bars(fsm, expired_ts);
+
+	fsm.cache_stats.sweeps++;
+	fsm.cache_stats.swept    += fsm.bar_cntxt_cache.size();
+	fsm.cache_stats.max_sweep = max(fsm.cache_stats.max_sweep, fsm.bar_cntxt_cache.size());
+
+	//Iterate the bar cache and close the bars that have expired
+	for( auto it = fsm.bar_cntxt_cache.begin() ; it != fsm.bar_cntxt_cache.end() ; ) {
+		BarCntxt & barcntxt  = it->second.bar;
+		FSM_TRACE  << "Worker 2 (FSM Thread) => processing timer_expiry: " << "symbol = " << it->first << ", bar_close_time = " << barcntxt.bar_close_time << ", expired_ts = " << expired_ts << endl;
+
+		if (expired_ts > barcntxt.bar_close_time ) {
+
+			//close the current bar and jump to the bar that accomodates the current expired timestamp
+			//(do not emit opening bars, emit bars only on closure of bars or trades)
+			fsm_close_bars_until(fsm, it->second, expired_ts, TIMER_EXP_CLOSING_BAR);
+		}
+
+		//evict the symbol if it has not traded for the TTL. With a TTL of a bar period or more its last traded bar closed above.
+		//With a shorter TTL the current bar may still hold trades : the eviction spills it open, and its closing bar is emitted
+		//from the spill cache once it expires (fsm_close_spilled_bars)
+		if ( fsm_symbol_ttl > 0 and expired_ts > it->second.last_trade_time + fsm_symbol_ttl ) {
+			it = fsm_evict_cntxt(fsm, it);
+			fsm.cache_stats.ttl_evictions++;
+			continue;
+		}
+
+		next_bar_close_time = min(next_bar_close_time, barcntxt.bar_close_time);
+		it++;
+	} 
+
+	fsm.next_bar_close_time = next_bar_close_time;
+return true;
+}
+
+
+
+//Create the clock timer for the wall clock. The event time clock has no timer
+bool fsm_clock_init() {
+	if (fsm_clock.type != FSM_CLOCK_WALL_TIME) {
+		return true;
+	}
+	fsm_clock.timer_fd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+	fsm_clock.armed_ts = 0;
+return fsm_clock.timer_fd >= 0;
+}
+
+
+
+//Current wall clock time in nanoseconds since the epoch, the same time base as TS2
+uint64_t fsm_clock_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+return (uint64_t) now.tv_sec * 1000000000UL + now.tv_nsec;
+}
+
+
+
+//Start time of the first bar of a symbol. With the event time clock the first bar starts with the first trade. With the wall clock
+//it starts at the interval boundary before the trade, so that the bars of all the symbols close together on the boundaries
+uint64_t fsm_clock_bar_start(uint64_t ts2) {
+	if (fsm_clock.type == FSM_CLOCK_WALL_TIME) {
+		return ts2 - ts2 % fifteen_sec_nanosecs;
+	}
+return ts2;
+}
+
+
+
+//Arm the clock timer for the earliest bar close in the bar cache. Bars close when the time is past their close time
+void fsm_clock_arm(FSMState & fsm) {
+	if (fsm_clock.timer_fd < 0) {
+		return;
+	}
+
+	uint64_t expiry_ts = (fsm.next_bar_close_time == UINT64_MAX) ? 0 : fsm.next_bar_close_time + 1;
+	if (expiry_ts == fsm_clock.armed_ts) {
+		return;
+	}
+
+	//an all zero it_value disarms the timer
+	struct itimerspec its;
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec  = expiry_ts / 1000000000UL;
+	its.it_value.tv_nsec = expiry_ts % 1000000000UL;
+
+	timerfd_settime(fsm_clock.timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+	fsm_clock.armed_ts = expiry_ts;
+}
+
+
+
+//The clock timer expired. Close the bars with a TIMER_EXPIRY event for the current time and arm the timer for the next close
+void fsm_clock_tick(FSMState & fsm) {
+	uint64_t expirations;
+	if ( read(fsm_clock.timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations) ) {
+		return;
+	}
+	fsm_clock.armed_ts = 0;
+
+	FSM_Event_Data_Timer_Exp tmr_exp;
+	tmr_exp.ts = fsm_clock_now();
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => clock tick : TS = " << tmr_exp.ts << ", delay after bar close = " << tmr_exp.ts - min(tmr_exp.ts, fsm.next_bar_close_time) << " ns" << endl;
+	fsm_fire_events<TIMER_EXPIRY>(fsm, &tmr_exp, 1);
+
+	fsm_clock_arm(fsm);
+}
+
+
+
+//Close the current bar and every bar up to time ts, and open the bar that accomodates ts in place. The current bar is emitted as a
+//closing bar of type bt. The empty bars after it are computed arithmetically and emitted as one EMPTY_BARS_GAP message, so an idle
+//period costs the same whatever its length. The footprint of the current bar is emitted right after its closing bar
+void fsm_close_bars_until(FSMState & fsm, SymbolCntxt & symcntxt, uint64_t ts, Bar_Type bt) {
+
+	BarCntxt & cntxt = symcntxt.bar;
+
+	//emit closing bar info to worker 3 
+	fsm_emit_bar(fsm, cntxt, bt);
+
+	Footprint *fp = symcntxt.footprint.get();
+	if ( fp != NULL and fp->lo <= fp->hi ) {
+		fsm_emit_footprint(symcntxt, FOOTPRINT_CLOSED);
+		footprint_reset(*fp);
+	}
+
+	fsm_roll_bar(cntxt);
+
+	if (ts <= cntxt.bar_close_time) {
+		return;
+	}
+
+	//bars from the current one up to the one before the bar that accomodates ts are empty
+	uint64_t empty_bars = (ts - cntxt.bar_close_time + bar_period_nanosecs - 1) / bar_period_nanosecs;
+
+	if (empty_bars < fsm_min_gap_bars) {
+		while (ts > cntxt.bar_close_time) {
+			fsm_emit_bar(fsm, cntxt, bt);
+			fsm_roll_bar(cntxt);
+		}
+		return;
+	}
+
+	fsm_emit_gap(fsm, cntxt, empty_bars);
+
+	cntxt.bar_num        += empty_bars;
+	cntxt.bar_start_time += empty_bars * bar_period_nanosecs;
+	cntxt.bar_close_time += empty_bars * bar_period_nanosecs;
+}
+
+
+
+//Close the bar in place and open the next one. The new bar is flat at the closing price of the previous bar
+void fsm_roll_bar(BarCntxt & barcntxt) {
+	barcntxt.bar_num        = barcntxt.bar_num + 1;
+	barcntxt.bar_start_time = barcntxt.bar_close_time + 1;
+	barcntxt.bar_close_time = barcntxt.bar_start_time + fifteen_sec_nanosecs;
+	barcntxt.bar_open       = barcntxt.bar_close;
+	barcntxt.bar_high       = barcntxt.bar_close;
+	barcntxt.bar_low        = barcntxt.bar_close;
+	barcntxt.bar_volume     = 0;
+}
+
+
+
+//Recompute the synthetic instruments that depend on sym from the latest bars of their legs and fire the derived prices
+//into the FSM as trades of the synthetic symbols. Synthetics only depend on symbols defined before them, so this terminates
+void fsm_update_synthetics(FSMState & fsm, const string & sym, uint64_t ts2) {
+
+	auto dep = synthetic_dependents.find(sym);
+	if ( dep == synthetic_dependents.end() ) {
+		return;
+	}
+
+	for (int idx : dep->second) {
+		const SyntheticInstrument & synth = synthetics[idx];
+
+		//derive the price. all the legs must have traded at least once
+		double price = 1.0;
+		const BarCntxt *grid = NULL;
+		size_t l;
+		for (l = 0; l < synth.legs.size(); l++) {
+			auto leg = fsm.bar_cntxt_cache.find(synth.legs[l]);
+			if ( leg == fsm.bar_cntxt_cache.end() or leg->second.bar.bar_close == 0.0 ) {
+				break;
+			}
+			price = (synth.exponents[l] > 0) ? price * leg->second.bar.bar_close : price / leg->second.bar.bar_close;
+			if (grid == NULL) {
+				grid = &leg->second.bar;
+			}
+		}
+
+		if ( l < synth.legs.size() ) {
+			continue;
+		}
+
+		FSM_TRACE  << "Worker 2 (FSM Thread) => sym = " << sym << ". Synthetic " << synth.sym << " updated : P = " << price << endl;
+
+		if ( fsm_find_cntxt(fsm, synth.sym) == NULL ) {
+			//first price of the synthetic. open its first bar on the bar boundaries of its first leg
+			//(copied before the new context is made room for, which may evict the leg)
+			uint64_t grid_start_time = grid->bar_start_time;
+			uint64_t grid_close_time = grid->bar_close_time;
+
+			SymbolCntxt & newsymcntxt = fsm_new_cntxt(fsm, synth.sym);
+			newsymcntxt.last_trade_time = ts2;
+
+			BarCntxt & newcntxt = newsymcntxt.bar;
+			strcpy(newcntxt.sym, synth.sym);
+			newcntxt.bar_num        = 1;
+			newcntxt.bar_start_time = grid_start_time;
+			newcntxt.bar_close_time = grid_close_time;
+			if ( ts2 > newcntxt.bar_close_time ) {
+				//the first leg has not closed its expired bars yet. skip ahead to the bar that holds ts2
+				uint64_t bars = (ts2 - newcntxt.bar_close_time + bar_period_nanosecs - 1) / bar_period_nanosecs;
+				newcntxt.bar_start_time += bars * bar_period_nanosecs;
+				newcntxt.bar_close_time += bars * bar_period_nanosecs;
+			}
+			newcntxt.bar_open       = price;
+			newcntxt.bar_high       = price;
+			newcntxt.bar_low        = price;
+			newcntxt.bar_close      = price;
+			newcntxt.bar_volume     = 0;
+
+			fsm.next_bar_close_time = min(fsm.next_bar_close_time, newcntxt.bar_close_time);
+		}
+
+		//synthetic trades carry no volume, only the implied price
+		FSM_Event_Data_Trade_Pkt synth_trd;
+		strcpy(synth_trd.sym, synth.sym);
+		synth_trd.price = price;
+		synth_trd.qty   = 0;
+		synth_trd.ts2   = ts2;
+		fsm_fire_events<TRADE_PKT_ARRIVAL>(fsm, &synth_trd, 1);
+	}
+}
+
+
+
+//Bar context of the symbol in the bar cache. An evicted symbol is brought back from the spill cache at the bar it was evicted in,
+//and the bars it missed are closed up to the latest timer expiry, as the sweeps would have done. NULL if the symbol is not known
+SymbolCntxt *fsm_find_cntxt(FSMState & fsm, const string & sym) {
+
+	auto it = fsm.bar_cntxt_cache.find(sym);
+	if ( it != fsm.bar_cntxt_cache.end() ) {
+		return &it->second;
+	}
+
+	auto spilled = fsm.spilled_cntxt_cache.find(sym);
+	if ( spilled == fsm.spilled_cntxt_cache.end() ) {
+		return NULL;
+	}
+
+	//taken out of the spill cache first : making room in the bar cache spills another symbol, which may drop this one
+	const SpilledCntxt spill = spilled->second;
+	fsm.spilled_order.erase(spill.order);
+	fsm.spilled_cntxt_cache.erase(spilled);
+
+	LOG(INFO)  << "Worker 2 (FSM Thread) => Resuming evicted symbol : sym = " << sym << ", bar_num = " << spill.bar_num << endl;
+
+	SymbolCntxt & symcntxt = fsm_new_cntxt(fsm, sym);
+	BarCntxt & cntxt = symcntxt.bar;
+	strcpy(cntxt.sym, sym.c_str());
+	cntxt.bar_num        = spill.bar_num;
+	cntxt.bar_close_time = spill.bar_close_time;
+	cntxt.bar_start_time = spill.bar_close_time - fifteen_sec_nanosecs;
+	cntxt.bar_open       = spill.bar_open;
+	cntxt.bar_high       = spill.bar_high;
+	cntxt.bar_low        = spill.bar_low;
+	cntxt.bar_close      = spill.bar_close;
+	cntxt.bar_volume     = spill.bar_volume;
+
+	fsm.cache_stats.resumed++;
+
+	if (fsm.last_expiry_ts > cntxt.bar_close_time) {
+		fsm_close_bars_until(fsm, symcntxt, fsm.last_expiry_ts, TIMER_EXP_CLOSING_BAR);
+	}
+
+	fsm.next_bar_close_time = min(fsm.next_bar_close_time, cntxt.bar_close_time);
+return &symcntxt;
+}
+
+
+
+//Insert a new symbol in the bar cache. If the cache is full, evict a symbol first with the clock algorithm: the hand walks the
+//cache clearing the referenced flags and evicts the first symbol that has not traded since the hand last passed it
+SymbolCntxt & fsm_new_cntxt(FSMState & fsm, const string & sym) {
+
+	while ( fsm_max_symbols > 0 and fsm.bar_cntxt_cache.size() >= fsm_max_symbols ) {
+		if ( fsm.evict_hand == fsm.bar_cntxt_cache.end() ) {
+			fsm.evict_hand = fsm.bar_cntxt_cache.begin();
+		}
+
+		if ( fsm.evict_hand->second.referenced ) {
+			fsm.evict_hand->second.referenced = false;
+			fsm.evict_hand++;
+		} else {
+			fsm.evict_hand = fsm_evict_cntxt(fsm, fsm.evict_hand);
+			fsm.cache_stats.cap_evictions++;
+		}
+	}
+
+	SymbolCntxt & symcntxt = fsm.bar_cntxt_cache[sym];
+	symcntxt.last_trade_time = 0;
+	symcntxt.referenced      = true;
+
+	//the footprint buckets are allocated once per symbol. The batch mode writes bars only
+	if ( footprints_enabled and fsm.bar_writer == NULL ) {
+		symcntxt.footprint.reset(new Footprint());
+		symcntxt.footprint->width     = 0;
+		symcntxt.footprint->lo        = footprint_buckets;
+		symcntxt.footprint->hi        = -1;
+		symcntxt.footprint->last_side = 0;
+		symcntxt.footprint->dirty     = false;
+	}
+return symcntxt;
+}
+
+
+
+//Evict a symbol from the bar cache. Its bar context is spilled to resume the bar sequence if it trades again and the publisher is
+//told to drop the symbol. Returns the next entry of the bar cache
+map<string, SymbolCntxt>::iterator fsm_evict_cntxt(FSMState & fsm, map<string, SymbolCntxt>::iterator it) {
+
+	const BarCntxt & cntxt = it->second.bar;
+
+	LOG(INFO)  << "Worker 2 (FSM Thread) => Evicting symbol : sym = " << it->first << ", bar_num = " << cntxt.bar_num 
+	           << ", last trade TS2 = " << it->second.last_trade_time << endl;
+
+	auto spilled = fsm.spilled_cntxt_cache.emplace(it->first, SpilledCntxt()).first;
+	SpilledCntxt & spill = spilled->second;
+	spill.order          = fsm.spilled_order.insert(fsm.spilled_order.end(), &spilled->first);
+	spill.bar_num        = cntxt.bar_num;
+	spill.bar_close_time = cntxt.bar_close_time;
+	spill.bar_open       = cntxt.bar_open;
+	spill.bar_high       = cntxt.bar_high;
+	spill.bar_low        = cntxt.bar_low;
+	spill.bar_close      = cntxt.bar_close;
+	spill.bar_volume     = cntxt.bar_volume;
+
+	fsm.outbound_cache.erase(it->first);
+
+	//the footprint of the open bar is not spilled. The bar resumes with an empty footprint. A footprint reset by a bar close in
+	//this batch is no longer dirty but still listed, so the list is searched whatever the flag
+	if ( it->second.footprint ) {
+		fsm.dirty_footprints.erase( remove(fsm.dirty_footprints.begin(), fsm.dirty_footprints.end(), &it->second), fsm.dirty_footprints.end() );
+	}
+
+	//the publisher drops the symbol once its open bar, if any, has been closed
+	if (cntxt.bar_volume > 0) {
+		fsm.spilled_open_bars.push_back(it->first);
+	} else {
+		BarMsg barmsg;
+		memset(&barmsg, 0, sizeof(barmsg));
+		barmsg.type = SYMBOL_EVICTED;
+		strcpy(barmsg.bar.sym, cntxt.sym);
+		fsm_send(fsm, barmsg);
+	}
+
+	//forget the oldest spilled symbols beyond the cap. An open bar is closed first, ahead of its time
+	while ( fsm_max_spilled > 0 and fsm.spilled_cntxt_cache.size() > fsm_max_spilled ) {
+		auto oldest = fsm.spilled_cntxt_cache.find( *fsm.spilled_order.front() );
+		if (oldest->second.bar_volume > 0) {
+			fsm_close_spilled(fsm, oldest->second, oldest->first);
+		}
+		fsm.spilled_order.pop_front();
+		fsm.spilled_cntxt_cache.erase(oldest);
+		fsm.cache_stats.spill_drops++;
+	}
+
+	//keep the clock hand valid
+	bool at_hand = (it == fsm.evict_hand);
+	it = fsm.bar_cntxt_cache.erase(it);
+	if (at_hand) {
+		fsm.evict_hand = it;
+	}
+return it;
+}
+
+
+
+//Emit the closing bar of a symbol evicted while its bar was open, roll the spilled bar and tell the publisher to drop the symbol
+void fsm_close_spilled(FSMState & fsm, SpilledCntxt & spill, const string & sym) {
+
+	BarCntxt cntxt;
+	strcpy(cntxt.sym, sym.c_str());
+	cntxt.bar_num        = spill.bar_num;
+	cntxt.bar_close_time = spill.bar_close_time;
+	cntxt.bar_start_time = spill.bar_close_time - fifteen_sec_nanosecs;
+	cntxt.bar_open       = spill.bar_open;
+	cntxt.bar_high       = spill.bar_high;
+	cntxt.bar_low        = spill.bar_low;
+	cntxt.bar_close      = spill.bar_close;
+	cntxt.bar_volume     = spill.bar_volume;
+
+	fsm_emit_bar(fsm, cntxt, TIMER_EXP_CLOSING_BAR);
+	fsm.outbound_cache.erase(sym);
+	fsm_roll_bar(cntxt);
+
+	spill.bar_num        = cntxt.bar_num;
+	spill.bar_close_time = cntxt.bar_close_time;
+	spill.bar_open       = cntxt.bar_open;
+	spill.bar_high       = cntxt.bar_high;
+	spill.bar_low        = cntxt.bar_low;
+	spill.bar_volume     = 0;
+
+	BarMsg barmsg;
+	memset(&barmsg, 0, sizeof(barmsg));
+	barmsg.type = SYMBOL_EVICTED;
+	strcpy(barmsg.bar.sym, cntxt.sym);
+	fsm_send(fsm, barmsg);
+}
+
+
+
+//Close the open bars of the spilled symbols that expired by ts. Symbols that traded again, or whose bar was already closed, are
+//dropped from the list. Returns the earliest close time of the open bars left
+uint64_t fsm_close_spilled_bars(FSMState & fsm, uint64_t ts) {
+
+	uint64_t next_bar_close_time = UINT64_MAX;
+
+	for (size_t i = 0; i < fsm.spilled_open_bars.size(); ) {
+		auto spilled = fsm.spilled_cntxt_cache.find(fsm.spilled_open_bars[i]);
+
+		if ( spilled != fsm.spilled_cntxt_cache.end() and spilled->second.bar_volume > 0 and ts <= spilled->second.bar_close_time ) {
+			next_bar_close_time = min(next_bar_close_time, spilled->second.bar_close_time);
+			i++;
+			continue;
+		}
+
+		if ( spilled != fsm.spilled_cntxt_cache.end() and spilled->second.bar_volume > 0 ) {
+			fsm_close_spilled(fsm, spilled->second, spilled->first);
+		}
+
+		fsm.spilled_open_bars[i] = fsm.spilled_open_bars.back();
+		fsm.spilled_open_bars.pop_back();
+	}
+return next_bar_close_time;
+}
+
+
+
+//Report the size of the bar cache and of the spill cache, the approximate memory they hold and the eviction and sweep counters
+void fsm_report_cache_stats(FSMState & fsm) {
+
+	//a map node holds the key, the value and about 4 pointers of tree links
+	const size_t node_overhead = 4 * sizeof(void *) + sizeof(string);
+
+	size_t bytes = fsm.bar_cntxt_cache.size()     * (node_overhead + sizeof(SymbolCntxt))
+	             + fsm.outbound_cache.size()      * (node_overhead + sizeof(BarCntxt))
+	             + fsm.spilled_cntxt_cache.size() * (node_overhead + sizeof(SpilledCntxt) + 3 * sizeof(void *));
+
+	stringstream ss;
+	ss << "Worker 2 (FSM Thread) => Bar cache : symbols = " << fsm.bar_cntxt_cache.size()
+	   << ", spilled = "        << fsm.spilled_cntxt_cache.size()
+	   << ", approx bytes = "   << bytes
+	   << ", ttl evictions = "  << fsm.cache_stats.ttl_evictions
+	   << ", cap evictions = "  << fsm.cache_stats.cap_evictions
+	   << ", resumed = "        << fsm.cache_stats.resumed
+	   << ", spill drops = "    << fsm.cache_stats.spill_drops
+	   << ", sweeps = "         << fsm.cache_stats.sweeps
+	   << ", avg sweep = "      << (fsm.cache_stats.sweeps ? fsm.cache_stats.swept / fsm.cache_stats.sweeps : 0)
+	   << ", max sweep = "      << fsm.cache_stats.max_sweep
+	   << endl;
+
+	LOG(INFO) << ss.str();
+	cout      << ss.str();
+}
+
+
+
+//Emit bar into to worker 3
+bool fsm_emit_bar(FSMState & fsm, const BarCntxt & barcntxt, Bar_Type bt){
+
+	//closing price is 0.0 for bars that are not closing bars. i.e trade bars / open bars etc
+	//actual closing price is emited only for bar types CLOSING_BAR and TIMER_EXP_CLOSING_BAR
+
+	double bar_close = barcntxt.bar_close;
+
+	if (bt == TRADE_BAR or bt == TIMER_EXP_OPENING_BAR) {
+		bar_close = 0.0;
+	}
+
+	string sym(barcntxt.sym);
+
+	//check if bar exists in outboud cache. emit the bar only in case of new bars / update of existing bars
+	auto it = fsm.outbound_cache.find(sym);
+	bool bar_exists = (it != fsm.outbound_cache.end());
+
+	if ( bar_exists == true ) {
+		const BarCntxt & prevctxt = it->second;
+	
+		if ( barcntxt.bar_num        == prevctxt.bar_num        and
+		     barcntxt.bar_open       == prevctxt.bar_open       and
+		     barcntxt.bar_high       == prevctxt.bar_high       and
+		     barcntxt.bar_low        == prevctxt.bar_low        and
+		     bar_close               == prevctxt.bar_close      and
+		     barcntxt.bar_volume     == prevctxt.bar_volume     and
+		     barcntxt.bar_start_time == prevctxt.bar_start_time and
+		     barcntxt.bar_close_time == prevctxt.bar_close_time ) {
+			//the bar need not be emitted if the values have not changed
+			FSM_TRACE  << "Worker 2 (FSM Thread) => Ignoring bar. No update in existing bar. " << "bartype = " << Bar_Type_Name[bt] 
+                 << ", symbol = " << barcntxt.sym 
+                 << ", bar_num = " << barcntxt.bar_num << endl;
+			return false;
+		}
+	} else {
+		//insert new entry in the outbound cache
+		it = fsm.outbound_cache.insert( pair<string, BarCntxt>(sym, barcntxt) ).first;
+	}
+
+	//the outbound cache entry is the copy of the bar that goes out
+	BarCntxt & outcntxt = it->second;
+	outcntxt = barcntxt;
+	outcntxt.bar_close = bar_close;
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => Emiting Bar : " 
+	             << "bartype = "          << Bar_Type_Name[bt] 
+	             << ", symbol = "         << outcntxt.sym 
+	             << ", bar_num = "        << outcntxt.bar_num
+	             << ", O = "              << outcntxt.bar_open
+	             << ", H = "              << outcntxt.bar_high
+	             << ", L = "              << outcntxt.bar_low
+	             << ", C = "              << outcntxt.bar_close
+	             << ", volume = "         << outcntxt.bar_volume
+	             << ", bar_start_time = " << outcntxt.bar_start_time
+	             << ", bar_close_time = " << outcntxt.bar_close_time
+	             << endl;
+
+	//write bar context into the pipe that takes the data to publisher thread
+	BarMsg barmsg;
+	barmsg.type     = bt;
+	barmsg.gap_bars = 0;
+	barmsg.bar      = outcntxt;
+	fsm_send(fsm, barmsg);
+return true;
+}
+
+
+
+//Emit a run of empty closed bars into to worker 3 as one message. first is the first empty bar
+void fsm_emit_gap(FSMState & fsm, const BarCntxt & first, uint64_t gap_bars) {
+
+	BarMsg barmsg;
+	barmsg.type     = EMPTY_BARS_GAP;
+	barmsg.gap_bars = gap_bars;
+	barmsg.bar      = first;
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => Emiting Bar : " 
+	             << "bartype = "          << Bar_Type_Name[EMPTY_BARS_GAP] 
+	             << ", symbol = "         << first.sym 
+	             << ", bar_num = "        << first.bar_num << " - " << first.bar_num + gap_bars - 1
+	             << ", O = H = L = C = "  << first.bar_close
+	             << ", bar_start_time = " << first.bar_start_time
+	             << ", bar_close_time = " << first.bar_close_time + (gap_bars - 1) * bar_period_nanosecs
+	             << endl;
+
+	//the outbound cache holds the last bar that went out
+	BarCntxt & outcntxt = fsm.outbound_cache[first.sym];
+	outcntxt = first;
+	outcntxt.bar_num        += gap_bars - 1;
+	outcntxt.bar_start_time += (gap_bars - 1) * bar_period_nanosecs;
+	outcntxt.bar_close_time += (gap_bars - 1) * bar_period_nanosecs;
+
+	fsm_send(fsm, barmsg);
+}
+
+
+
+//Send a bar message out of the FSM: to the publisher, or to the bar writer of the shard in batch mode
+void fsm_send(FSMState & fsm, const BarMsg & barmsg) {
+
+	if (fsm.bar_writer != NULL) {
+		bar_writer_add(*fsm.bar_writer, barmsg);
+		return;
+	}
+
+	if (shard_filter_updates) {
+		if (barmsg.type == TRADE_BAR and !shard_interested(barmsg.bar.sym)) {
+			return;
+		}
+		if (barmsg.type == SYMBOL_EVICTED) {
+			shard_interest_cache.erase(barmsg.bar.sym);
+		}
+	}
+	write(pfd_w2_w3[1], &barmsg, sizeof(barmsg));
+}
+
+
+
+//Add a trade to a footprint. The side is given by the tick rule: an uptick is a buy, a downtick a sell, and a trade at the
+//same price has the side of the previous trade
+void footprint_add(Footprint & fp, double price, double qty) {
+
+	if ( !(price > 0 and isfinite(price)) ) {
+		return;
+	}
+
+	if (fp.width == 0) {
+		fp.width = price * footprint_initial_width;
+	}
+
+	if (fp.lo > fp.hi) {
+		//first trade of the bar. center the buckets on it, aligned on the bucket width
+		fp.base = (floor(price / fp.width) - footprint_buckets / 2) * fp.width;
+	}
+
+	double pos = (price - fp.base) / fp.width;
+	while (pos < 0 or pos >= footprint_buckets) {
+		footprint_widen(fp, pos < 0);
+		pos = (price - fp.base) / fp.width;
+	}
+	int b = min((int) pos, footprint_buckets - 1);
+
+	//the first trade of the symbol has no previous price to tell the side
+	if (fp.last_price > 0 and price != fp.last_price) {
+		fp.last_side = (price > fp.last_price) ? 1 : -1;
+	}
+	fp.last_price = price;
+
+	fp.volume[b] += qty;
+	if (fp.last_side > 0) {
+		fp.buy[b]  += qty;
+	} else if (fp.last_side < 0) {
+		fp.sell[b] += qty;
+	}
+
+	fp.lo = min(fp.lo, b);
+	fp.hi = max(fp.hi, b);
+}
+
+
+
+//Double the bucket width of a footprint, merging the buckets in pairs. The buckets grow downwards if down, else upwards
+void footprint_widen(Footprint & fp, bool down) {
+
+	int shift = down ? footprint_buckets : 0;
+	int lo = footprint_buckets, hi = -1;
+
+	for (int b = 0; b < footprint_buckets; b++) {
+		if (b < fp.lo or b > fp.hi) {
+			continue;
+		}
+
+		double volume = fp.volume[b], buy = fp.buy[b], sell = fp.sell[b];
+		fp.volume[b] = fp.buy[b] = fp.sell[b] = 0;
+
+		int nb = (b + shift) / 2;
+		fp.volume[nb] += volume;
+		fp.buy[nb]    += buy;
+		fp.sell[nb]   += sell;
+
+		lo = min(lo, nb);
+		hi = max(hi, nb);
+	}
+
+	if (down) {
+		fp.base -= footprint_buckets * fp.width;
+	}
+	fp.width *= 2;
+	fp.lo = lo;
+	fp.hi = hi;
+}
+
+
+
+//Clear a footprint for the next bar. Only the buckets that were used are cleared. A bar that used only a few buckets halves
+//the bucket width for the next bar, down to footprint_min_width
+void footprint_reset(Footprint & fp) {
+
+	if (fp.lo > fp.hi) {
+		return;
+	}
+
+	if ( fp.hi - fp.lo < footprint_buckets / 8 and fp.width / 2 >= fp.last_price * footprint_min_width ) {
+		fp.width /= 2;
+	}
+
+	for (int b = fp.lo; b <= fp.hi; b++) {
+		fp.volume[b] = fp.buy[b] = fp.sell[b] = 0;
+	}
+
+	fp.lo    = footprint_buckets;
+	fp.hi    = -1;
+	fp.dirty = false;
+}
+
+
+
+//Emit the footprint of the current bar of a symbol into to worker 3, or append it to out to be written later
+void fsm_emit_footprint(const SymbolCntxt & symcntxt, Bar_Type bt, string *out) {
+
+	const Footprint & fp = *symcntxt.footprint;
+
+	FootprintMsg fpmsg;
+	fpmsg.type    = bt;
+	fpmsg.bar_num = symcntxt.bar.bar_num;
+	strcpy(fpmsg.sym, symcntxt.bar.sym);
+	fpmsg.lo      = fp.lo;
+	fpmsg.hi      = fp.hi;
+	fpmsg.base    = fp.base;
+	fpmsg.width   = fp.width;
+	memcpy(fpmsg.volume, fp.volume, sizeof(fp.volume));
+	memcpy(fpmsg.buy,    fp.buy,    sizeof(fp.buy));
+	memcpy(fpmsg.sell,   fp.sell,   sizeof(fp.sell));
+
+	FSM_TRACE  << "Worker 2 (FSM Thread) => Emiting footprint : " << Bar_Type_Name[bt] << ", symbol = " << fpmsg.sym 
+	           << ", bar_num = " << fpmsg.bar_num << ", buckets = " << fp.hi - fp.lo + 1 << ", width = " << fp.width << endl;
+
+	if (out != NULL) {
+		out->append((const char *) &fpmsg, sizeof(fpmsg));
+		return;
+	}
+	write(pfd_w2_w3[1], &fpmsg, sizeof(fpmsg));
+}
+
+
+
+//Send one update for every footprint that changed in the batch of trades just processed. The updates go down the pipe in one write
+void fsm_flush_footprints(FSMState & fsm) {
+
+	if ( fsm.dirty_footprints.empty() ) {
+		return;
+	}
+
+	string & updates = fsm.footprint_updates;
+
+	for (SymbolCntxt *symcntxt : fsm.dirty_footprints) {
+		Footprint & fp = *symcntxt->footprint;
+		if (fp.dirty) {
+			//a backend of the sharded mode sends the updates of the symbols with subscribers only
+			if ( !shard_filter_updates or shard_interested(symcntxt->bar.sym) ) {
+				fsm_emit_footprint(*symcntxt, FOOTPRINT_UPDATE, &updates);
+			}
+			fp.dirty = false;
+		}
+	}
+	fsm.dirty_footprints.clear();
+
+	write_all(pfd_w2_w3[1], updates.data(), updates.size());
+	updates.clear();
+}
+
+
+
+//Fire a batch of packets from Worker 1 into the FSM. Runs of trades are fired as one batch. Time ticks (the packets without
+//a symbol, batch mode and sharded mode) fire a timer expiry. Returns the number of trades
+size_t fsm_fire_packets(FSMState & fsm, const tradepacket * batch, size_t count) {
+
+	size_t trades = 0;
+	size_t i = 0;
+	while (i < count) {
+		if (batch[i].sym[0] == '\0') {
+			FSM_Event_Data_Timer_Exp tmr_exp;
+			tmr_exp.ts = batch[i].ts2;
+			fsm_fire_events<TIMER_EXPIRY>(fsm, &tmr_exp, 1);
+			i++;
+			continue;
+		}
+
+		size_t j = i;
+		while (j < count and batch[j].sym[0] != '\0') {
+			j++;
+		}
+		fsm_fire_events<TRADE_PKT_ARRIVAL>(fsm, batch + i, j - i);
+		trades += j - i;
+		i = j;
+	}
+return trades;
+}
+
+
+
+//Size of a message on the bars pipe, from its type
+size_t bar_msg_size(Bar_Type type) {
+	return (type == FOOTPRINT_UPDATE or type == FOOTPRINT_CLOSED) ? sizeof(FootprintMsg) : sizeof(BarMsg);
+}
+
+
+
+//Thread 2 in batch mode: FSM of a symbol shard. Reads the trade packets and time ticks of the shard until EOF and writes the bars
+void *fsm_thread_batch(void *msg) {
+
+	FSMShard *shard = static_cast<FSMShard*>(msg);
+
+	stage_thread_start(STAGE_FSM, "fsm");
+
+	//built here, pinned, rather than by the main thread
+	shard->writer.reset(new BarWriter());
+	shard->fsm.reset(new FSMState());
+
+	if ( !bar_writer_open(*shard->writer, shard->fd, batch_format) ) {
+		cout      << "Error writing bars file : " << shard->path << endl;
+		LOG(INFO) << "Error writing bars file : " << shard->path << endl;
+	}
+
+	FSMState & fsm = *shard->fsm;
+	fsm.bar_writer = shard->writer.get();
+	fsm.curr_state = FSM_READY;
+
+	tradepacket batch[fsm_batch_size];
+	size_t carry = 0;
+
+	ssize_t r;
+	while ( (r = read(shard->pfd[0], (char *) batch + carry, sizeof(batch) - carry)) > 0 ) {
+		size_t bytes = carry + r;
+		size_t count = bytes / sizeof(tradepacket);
+
+		shard->trades += fsm_fire_packets(fsm, batch, count);
+
+		carry = bytes % sizeof(tradepacket);
+		memmove(batch, (char *) batch + count * sizeof(tradepacket), carry);
+	}
+	close(shard->pfd[0]);
+
+	bar_writer_flush(*shard->writer);
+	close(shard->writer->fd);
+	fsm_report_cache_stats(fsm);
+
+return NULL;
+}
+
+
+
+//Start a bars file of the batch mode on its open fd and write its header : the column names of a CSV file, the magic of a binary file
+bool bar_writer_open(BarWriter & writer, int fd, Batch_Format format) {
+
+	writer.fd         = fd;
+	writer.format     = format;
+	writer.rows       = 0;
+	writer.total_rows = 0;
+	writer.bytes      = 0;
+
+	string header = (format == BATCH_FORMAT_CSV) ? "type,symbol,bar_num,bar_start_time,bar_close_time,open,high,low,close,volume\n" : "OHLCBAR1";
+	writer.bytes += header.size();
+return write_all(writer.fd, header.data(), header.size());
+}
+
+
+
+//Add a bar message to the bars file. Gaps are written as their empty bars, trade bars only if requested, evictions not at all.
+//The doubles are written with all their digits (CSV) or bits (binary), so the bars are exactly the bars of the live server.
+//Whether a run of empty bars closes as one gap or bar by bar depends on how often the timer expires, which depends on the
+//shard count. The empty bars of a gap are written with the type of an empty bar closed on its own, so the rows do not
+void bar_writer_add(BarWriter & writer, const BarMsg & barmsg) {
+
+	if ( barmsg.type == SYMBOL_EVICTED or (barmsg.type == TRADE_BAR and !batch_trade_bars) ) {
+		return;
+	}
+
+	unsigned int nbars = (barmsg.type == EMPTY_BARS_GAP) ? barmsg.gap_bars : 1;
+	Bar_Type type      = (barmsg.type == EMPTY_BARS_GAP) ? TIMER_EXP_CLOSING_BAR : barmsg.type;
+
+	for (unsigned int k = 0; k < nbars; k++) {
+		const BarCntxt & bar = barmsg.bar;
+		unsigned int bar_num    = bar.bar_num + k;
+		uint64_t bar_start_time = bar.bar_start_time + k * bar_period_nanosecs;
+		uint64_t bar_close_time = bar.bar_close_time + k * bar_period_nanosecs;
+
+		if (writer.format == BATCH_FORMAT_CSV) {
+			char row[384];
+			int len = snprintf(row, sizeof(row), "%s,%s,%u,%" PRIu64 ",%" PRIu64 ",%.17g,%.17g,%.17g,%.17g,%.17g\n",
+			                   Bar_Type_Name[type].c_str(), bar.sym, bar_num, bar_start_time, bar_close_time,
+			                   bar.bar_open, bar.bar_high, bar.bar_low, bar.bar_close, bar.bar_volume);
+			writer.text.append(row, len);
+		} else {
+			writer.type.push_back(type);
+			writer.sym.insert(writer.sym.end(), bar.sym, bar.sym + sizeof(bar.sym));
+			writer.bar_num.push_back(bar_num);
+			writer.bar_start_time.push_back(bar_start_time);
+			writer.bar_close_time.push_back(bar_close_time);
+			writer.bar_open.push_back(bar.bar_open);
+			writer.bar_high.push_back(bar.bar_high);
+			writer.bar_low.push_back(bar.bar_low);
+			writer.bar_close.push_back(bar.bar_close);
+			writer.bar_volume.push_back(bar.bar_volume);
+		}
+
+		writer.rows++;
+		writer.total_rows++;
+
+		if (writer.rows == batch_row_group_rows) {
+			bar_writer_flush(writer);
+		}
+	}
+}
+
+
+
+//Write out the current row group. A binary row group is the row count followed by the columns:
+//type (uint8), symbol (char[15]), bar_num (uint32), bar_start_time, bar_close_time (uint64), open, high, low, close, volume (double)
+void bar_writer_flush(BarWriter & writer) {
+
+	if (writer.rows == 0) {
+		return;
+	}
+
+	if (writer.format == BATCH_FORMAT_CSV) {
+		write_all(writer.fd, writer.text.data(), writer.text.size());
+		writer.bytes += writer.text.size();
+		writer.text.clear();
+	} else {
+		uint32_t rows = writer.rows;
+
+		auto column = [&writer](const void *data, size_t len) {
+			write_all(writer.fd, (const char *) data, len);
+			writer.bytes += len;
+		};
+
+		column(&rows, sizeof(rows));
+		column(writer.type.data(),           rows * sizeof(uint8_t));
+		column(writer.sym.data(),            rows * sizeof(BarCntxt::sym));
+		column(writer.bar_num.data(),        rows * sizeof(uint32_t));
+		column(writer.bar_start_time.data(), rows * sizeof(uint64_t));
+		column(writer.bar_close_time.data(), rows * sizeof(uint64_t));
+		column(writer.bar_open.data(),       rows * sizeof(double));
+		column(writer.bar_high.data(),       rows * sizeof(double));
+		column(writer.bar_low.data(),        rows * sizeof(double));
+		column(writer.bar_close.data(),      rows * sizeof(double));
+		column(writer.bar_volume.data(),     rows * sizeof(double));
+
+		writer.type.clear();
+		writer.sym.clear();
+		writer.bar_num.clear();
+		writer.bar_start_time.clear();
+		writer.bar_close_time.clear();
+		writer.bar_open.clear();
+		writer.bar_high.clear();
+		writer.bar_low.clear();
+		writer.bar_close.clear();
+		writer.bar_volume.clear();
+	}
+
+	writer.rows = 0;
+}
+
+
+
+//Dispatch of the FSM before the compile time handler table, the baseline of the FSM benchmark : a table of handler pointers
+//looked up by state and event for every event, the event data copied into an FSM_EVENT
+typedef bool (*FSM_EVENT_HANDLER) (FSMState &, FSM_EVENT &);
+
+bool bench_fsm_starting(FSMState & fsm, FSM_EVENT &)                        { return process_fsm_starting(fsm); }
+bool bench_fsm_ready_ev_trd_pkt_arrival(FSMState & fsm, FSM_EVENT & fsm_ev) { return process_fsm_ready_ev_trd_pkt_arrival(fsm, fsm_ev.data.trd_pkt); }
+bool bench_fsm_ready_ev_tmr_expiry(FSMState & fsm, FSM_EVENT & fsm_ev)      { return process_fsm_ready_ev_tmr_expiry(fsm, fsm_ev.data.tmr_exp); }
+bool bench_fsm_down(FSMState & fsm, FSM_EVENT &)                            { return process_fsm_down(fsm); }
+
+FSM_EVENT_HANDLER Bench_FSM_Ev_Handler_Table[FSM_STATE_COUNT][EVENT_TYPE_COUNT] = {
+                                                                                    bench_fsm_starting, bench_fsm_starting,
+                                                                                    bench_fsm_ready_ev_trd_pkt_arrival, bench_fsm_ready_ev_tmr_expiry,
+                                                                                    bench_fsm_down, bench_fsm_down
+                                                                                  };
+
+
+//FSM microbenchmark. Fires synthetic trades for a set of symbols thru the FSM in batches and reports the per-event cost of the
+//handler table and of the compile time dispatch, each on a fresh FSM. Bars are emitted into /dev/null instead of the publisher
+//pipe. The per event trace of the FSM is part of the cost unless it is compiled out (FSM_NO_TRACE)
+void fsm_benchmark(unsigned long num_trades) {
+
+	const int num_symbols = 64;
+
+	vector<tradepacket> trades(num_trades);
+	double prices[num_symbols];
+	uint64_t ts2 = 1538409725339216503UL;
+
+	for (int i = 0; i < num_symbols; i++) {
+		prices[i] = 100.0 + i;
+	}
+
+	srand(1);
+	for (unsigned long i = 0; i < num_trades; i++) {
+		int s = rand() % num_symbols;
+		prices[s] += ((rand() % 201) - 100) * 0.001;
+		ts2 += (rand() % 200) * 1000000UL;
+
+		snprintf(trades[i].sym, sizeof(trades[i].sym), "BENCH%d", s);
+		trades[i].price = prices[s];
+		trades[i].qty   = (rand() % 1000) * 0.01;
+		trades[i].ts2   = ts2;
+	}
+
+	pfd_w2_w3[1] = open("/dev/null", O_WRONLY);
+
+	//baseline : table lookup and FSM_EVENT copy per event
+	FSMState table_fsm;
+	table_fsm.curr_state = FSM_READY;
+
+	auto start = chrono::steady_clock::now();
+
+	for (unsigned long i = 0; i < num_trades; i += fsm_batch_size) {
+		unsigned long end = min(i + fsm_batch_size, num_trades);
+		for (unsigned long j = i; j < end; j++) {
+			FSM_EVENT fsm_ev;
+			fsm_ev.type         = TRADE_PKT_ARRIVAL;
+			fsm_ev.data.trd_pkt = trades[j];
+			Bench_FSM_Ev_Handler_Table[table_fsm.curr_state][fsm_ev.type](table_fsm, fsm_ev);
 		}
-		else {
-			LOG(INFO)  << "Worker 2 (FSM Thread) => Timeout occured while reading trade data. No trade data to read from source pipe fd" << endl;
-			cout       << "Worker 2 (FSM Thread) => Timeout occured while reading trade data. No trade data to read from source pipe fd" << endl;
+		fsm_flush_footprints(table_fsm);
+	}
+
+	auto table_elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+	//compile time dispatch of the batches, as the FSM thread fires them
+	FSMState fsm;
+	fsm.curr_state = FSM_READY;
+
+	start = chrono::steady_clock::now();
+
+	for (unsigned long i = 0; i < num_trades; i += fsm_batch_size) {
+		fsm_fire_events<TRADE_PKT_ARRIVAL>(fsm, &trades[i], min((unsigned long) fsm_batch_size, num_trades - i));
+		fsm_flush_footprints(fsm);
+	}
+
+	auto elapsed = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+
+#ifdef FSM_NO_TRACE
+	const char *trace = "compiled out";
+#else
+	const char *trace = "logged";
+#endif
+
+	stringstream ss;
+	ss << "FSM benchmark : " << num_trades << " trades, " << num_symbols << " symbols, FSM trace " << trace << endl
+	   << "    handler table         : " << (double) table_elapsed / num_trades << " ns/event, "
+	   << (uint64_t) (num_trades * 1e9 / table_elapsed) << " events/sec" << endl
+	   << "    compile time dispatch : " << (double) elapsed / num_trades << " ns/event, "
+	   << (uint64_t) (num_trades * 1e9 / elapsed) << " events/sec" << endl;
+	cout      << ss.str();
+	LOG(INFO) << ss.str();
+
+	close(pfd_w2_w3[1]);
+}
+
+
+
+
+//Create the shared memory table of the latest bars. A table left by an earlier run is replaced, readers map the new one
+bool shm_bar_table_create(const char *name) {
+
+	shm_unlink(name);
+
+	int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0) {
+		return false;
+	}
+
+	size_t size = shm_bar_table_size(shm_bar_table_num_slots);
+	if ( ftruncate(fd, size) < 0 ) {
+		close(fd);
+		return false;
+	}
+
+	void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+
+	//the object is zero filled : all the slots are free. The magic goes last, readers check it
+	shm_bar_table = static_cast<ShmBarTableHeader *>(addr);
+	shm_bar_table->version   = SHM_BAR_TABLE_VERSION;
+	shm_bar_table->num_slots = shm_bar_table_num_slots;
+	atomic_thread_fence(memory_order_release);
+	strcpy(shm_bar_table->magic, "OHLCSHM");
+
+	LOG(INFO)  << "Worker 3 (Publisher Thread) => Shared memory bar table : " << name << ", slots = " << shm_bar_table_num_slots << ", bytes = " << size << endl;
+	cout       << "Worker 3 (Publisher Thread) => Shared memory bar table : " << name << ", slots = " << shm_bar_table_num_slots << ", bytes = " << size << endl;
+return true;
+}
+
+
+
+//Write a bar message into the slot of its symbol in the shared memory table. The publisher thread is the only writer.
+//The slot is written between two increments of its sequence number (seqlock), readers retry if it changed while they copied
+void shm_bar_table_update(const BarMsg & barmsg) {
+
+	if ( shm_bar_table == NULL or barmsg.type == SYMBOL_EVICTED ) {
+		return;
+	}
+
+	const BarCntxt & bar = barmsg.bar;
+
+	//find the slot of the symbol, or the free slot it goes into
+	ShmBarSlot *slots = shm_bar_table_slots(shm_bar_table);
+	uint32_t mask = shm_bar_table->num_slots - 1;
+	ShmBarSlot *slot = NULL;
+
+	uint32_t pos = shm_bar_table_hash(bar.sym) & mask;
+	for (uint32_t i = 0; i <= mask; i++, pos = (pos + 1) & mask) {
+		if ( slots[pos].used.load(memory_order_relaxed) == 0 or strncmp(slots[pos].sym, bar.sym, sizeof(slots[pos].sym)) == 0 ) {
+			slot = &slots[pos];
+			break;
+		}
+	}
+
+	if (slot == NULL) {
+		LOG(INFO)  << "Worker 3 (Publisher Thread) => Shared memory bar table full. Not writing symbol : " << bar.sym << endl;
+		return;
+	}
+
+	uint32_t seq = slot->seq.load(memory_order_relaxed);
+	slot->seq.store(seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+
+	if ( slot->used.load(memory_order_relaxed) == 0 ) {
+		strncpy(slot->sym, bar.sym, sizeof(slot->sym));
+		slot->closed_bars = 0;
+		slot->used.store(1, memory_order_release);
+		shm_bar_table->used_slots.fetch_add(1, memory_order_release);
+	}
+
+	//a gap stands for gap_bars closed bars. The latest bar is the last of them, only the last SHM_BAR_HISTORY are kept
+	uint64_t nbars = (barmsg.type == EMPTY_BARS_GAP) ? barmsg.gap_bars : 1;
+
+	for (uint64_t k = (nbars > SHM_BAR_HISTORY) ? nbars - SHM_BAR_HISTORY : 0; k < nbars; k++) {
+		ShmBar & shmbar = slot->latest;
+		shmbar.type           = barmsg.type;
+		shmbar.bar_num        = bar.bar_num + k;
+		shmbar.bar_start_time = bar.bar_start_time + k * bar_period_nanosecs;
+		shmbar.bar_close_time = bar.bar_close_time + k * bar_period_nanosecs;
+		shmbar.bar_open       = bar.bar_open;
+		shmbar.bar_high       = bar.bar_high;
+		shmbar.bar_low        = bar.bar_low;
+		shmbar.bar_close      = bar.bar_close;
+		shmbar.bar_volume     = bar.bar_volume;
+
+		if ( barmsg.type == CLOSING_BAR or barmsg.type == TIMER_EXP_CLOSING_BAR or barmsg.type == EMPTY_BARS_GAP ) {
+			slot->closed[ (slot->closed_bars + k) % SHM_BAR_HISTORY ] = shmbar;
+		}
+	}
+
+	if ( barmsg.type == CLOSING_BAR or barmsg.type == TIMER_EXP_CLOSING_BAR or barmsg.type == EMPTY_BARS_GAP ) {
+		slot->closed_bars += nbars;
+	}
+
+	slot->seq.store(seq + 2, memory_order_release);
+}
+
+
+
+//Load the CPUs of the pipeline stages (-A) : "stage=cpus,stage=cpus.." or a file with a "<stage> <cpus>" line per stage.
+//A cpu list is like 0-3,8. Every stage not given keeps floating
+bool load_stage_affinity(const string & spec) {
+
+	//stage and cpu list pairs
+	vector< pair<string, string> > entries;
+
+	if (spec.find('=') != string::npos) {
+		//the commas separate the stages and the cpus of a list. A token with = starts a stage
+		for (const string & token : tokenize(spec.c_str(), ',')) {
+			size_t eq = token.find('=');
+			if (eq != string::npos) {
+				entries.push_back( pair<string, string>(token.substr(0, eq), token.substr(eq + 1)) );
+			} else if ( !entries.empty() ) {
+				entries.back().second += "," + token;
+			} else {
+				return false;
+			}
+		}
+	} else {
+		ifstream affinityfile(spec);
+		if ( !affinityfile.is_open() ) {
+			return false;
+		}
+
+		string line;
+		while (getline(affinityfile, line)) {
+			istringstream is(line);
+			string stage, cpus;
+			if ( !(is >> stage) or stage[0] == '#' ) {
+				continue;
+			}
+			if ( !(is >> cpus) ) {
+				return false;
+			}
+			entries.push_back( pair<string, string>(stage, cpus) );
+		}
+	}
+
+	for (const auto & entry : entries) {
+		auto it = find(Pipeline_Stage_Name.begin(), Pipeline_Stage_Name.begin() + STAGE_COUNT, entry.first);
+		if ( it == Pipeline_Stage_Name.begin() + STAGE_COUNT ) {
+			LOG(INFO) << "Unknown pipeline stage : " << entry.first << endl;
+			return false;
+		}
+
+		vector<int> & cpus = stage_cpus[it - Pipeline_Stage_Name.begin()];
+		cpus.clear();
+		if ( !parse_cpu_list(entry.second, cpus) ) {
+			LOG(INFO) << "Invalid cpu list for stage " << entry.first << " : " << entry.second << endl;
+			return false;
+		}
+	}
+return true;
+}
+
+
+
+//Parse a cpu list like 0-3,8 into cpus. The cpus must exist
+bool parse_cpu_list(const string & list, vector<int> & cpus) {
+
+	long ncpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	for (const string & range : tokenize(list.c_str(), ',')) {
+		if ( range.empty() ) {
+			continue;
+		}
+
+		if ( !isdigit(range[0]) or !isdigit(range.back()) ) {
+			return false;
+		}
+
+		char *end;
+		long first = strtol(range.c_str(), &end, 10);
+		long last  = first;
+		if (*end == '-') {
+			last = strtol(end + 1, &end, 10);
+		}
+
+		if (*end != '\0' or last < first or last >= min(ncpus, (long) CPU_SETSIZE)) {
+			return false;
+		}
+		for (long cpu = first; cpu <= last; cpu++) {
+			cpus.push_back(cpu);
+		}
+	}
+
+	sort(cpus.begin(), cpus.end());
+	cpus.erase( unique(cpus.begin(), cpus.end()), cpus.end() );
+return !cpus.empty();
+}
+
+
+
+//Format cpus as a cpu list, with ranges for the runs of consecutive cpus
+string format_cpu_list(const vector<int> & cpus) {
+
+	string list;
+	for (size_t i = 0; i < cpus.size(); ) {
+		size_t j = i;
+		while (j + 1 < cpus.size() and cpus[j + 1] == cpus[j] + 1) {
+			j++;
+		}
+
+		list += (list.empty() ? "" : ",") + to_string(cpus[i]);
+		if (j > i) {
+			list += "-" + to_string(cpus[j]);
+		}
+		i = j + 1;
+	}
+return list;
+}
+
+
+
+//NUMA node of a cpu. -1 when not known (no libnuma)
+int cpu_numa_node(int cpu) {
+#ifdef WITH_NUMA
+	if (numa_available() >= 0) {
+		return numa_node_of_cpu(cpu);
+	}
+#else
+	(void) cpu;
+#endif
+return -1;
+}
+
+
+
+//Name the calling thread and pin it to the next CPU of its stage. Called first thing in every thread, before it touches its
+//caches and buffers, so that the kernel's default local allocation puts them on the node of its CPU. With libnuma the thread
+//also prefers that node explicitly, which overrides a policy the process was started with (numactl --interleave)
+void stage_thread_start(Pipeline_Stage stage, const char *name) {
+
+	pthread_setname_np(pthread_self(), name);
+
+	const vector<int> & cpus = stage_cpus[stage];
+	if ( cpus.empty() ) {
+		return;
+	}
+
+	int cpu = cpus[stage_threads[stage]++ % cpus.size()];
+
+	cpu_set_t cpuset;
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+
+	int err = pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset);
+	if (err != 0) {
+		LOG(INFO) << "Error pinning thread " << name << " to cpu " << cpu << " : " << strerror(err) << endl;
+		return;
+	}
+
+#ifdef WITH_NUMA
+	if (numa_available() >= 0 and cpu_numa_node(cpu) >= 0) {
+		numa_set_preferred( cpu_numa_node(cpu) );
+	}
+#endif
+
+	LOG(INFO) << "Thread " << name << " (" << Pipeline_Stage_Name[stage] << ") pinned to cpu " << cpu << ", numa node " << cpu_numa_node(cpu) << endl;
+}
+
+
+
+//Stages run by the backends of the sharded mode. The publisher runs in the gateway
+const Pipeline_Stage shard_backend_stages[] = { STAGE_READER, STAGE_SOURCE, STAGE_DECOMPRESS, STAGE_FSM };
+
+
+
+//Backend of the sharded mode: keep its own slice of the CPU list of every stage it runs, so that the threads of different
+//backends do not share a CPU. A list with fewer CPUs than backends cannot be split: backend k gets CPU k modulo the list,
+//shared with other backends (the gateway warns about it)
+void shard_stage_cpus() {
+
+	for (Pipeline_Stage stage : shard_backend_stages) {
+		vector<int> & cpus = stage_cpus[stage];
+		if ( cpus.empty() ) {
+			continue;
+		}
+
+		size_t n = cpus.size();
+		size_t k = process_shard_index;
+		if (n < process_shard_count) {
+			cpus = vector<int>(1, cpus[k % n]);
+		} else {
+			cpus = vector<int>(cpus.begin() + k * n / process_shard_count, cpus.begin() + (k + 1) * n / process_shard_count);
+		}
+	}
+}
+
+
+
+//Report the cpus and NUMA nodes of the host and where the stages run. Warns about the stages next to each other in the
+//pipeline that are pinned to different nodes: the pipe between them crosses the interconnect
+void report_topology() {
+
+	stringstream ss;
+	ss << "Topology : cpus = " << sysconf(_SC_NPROCESSORS_ONLN);
+
+#ifdef WITH_NUMA
+	if (numa_available() >= 0) {
+		ss << ", numa nodes = " << numa_max_node() + 1 << endl;
+
+		struct bitmask *mask = numa_allocate_cpumask();
+		for (int node = 0; node <= numa_max_node(); node++) {
+			vector<int> cpus;
+			if ( numa_node_to_cpus(node, mask) == 0 ) {
+				for (unsigned int cpu = 0; cpu < mask->size; cpu++) {
+					if ( numa_bitmask_isbitset(mask, cpu) ) {
+						cpus.push_back(cpu);
+					}
+				}
+			}
+			ss << "    node " << node << " : cpus " << format_cpu_list(cpus) << endl;
+		}
+		numa_free_cpumask(mask);
+	} else {
+		ss << ", numa not available" << endl;
+	}
+#else
+	ss << ", numa nodes not known (built without libnuma)" << endl;
+#endif
+
+	//node of every stage : -1 not known, -2 spread over several nodes
+	int stage_node[STAGE_COUNT];
+
+	for (int stage = 0; stage < STAGE_COUNT; stage++) {
+		const vector<int> & cpus = stage_cpus[stage];
+		stage_node[stage] = -1;
+
+		ss << "    " << setw(10) << left << Pipeline_Stage_Name[stage] << " : ";
+		if ( cpus.empty() ) {
+			ss << "not pinned" << endl;
+			continue;
+		}
+
+		set<int> nodes;
+		for (int cpu : cpus) {
+			nodes.insert( cpu_numa_node(cpu) );
+		}
+		stage_node[stage] = (nodes.size() == 1) ? *nodes.begin() : -2;
+
+		ss << "cpus " << format_cpu_list(cpus) << ", numa node ";
+		if (stage_node[stage] == -2) {
+			ss << "several";
+		} else {
+			ss << stage_node[stage];
+		}
+		ss << endl;
+	}
+
+	//stages connected by a pipe
+	const Pipeline_Stage links[][2] = { { STAGE_DECOMPRESS, STAGE_SOURCE }, { STAGE_SOURCE, STAGE_READER }, 
+	                                    { STAGE_READER, STAGE_FSM }, { STAGE_FSM, STAGE_PUBLISHER } };
+	for (const auto & link : links) {
+		int from = stage_node[link[0]], to = stage_node[link[1]];
+		if ( from >= 0 and to >= 0 and from != to ) {
+			ss << "    warning : " << Pipeline_Stage_Name[link[0]] << " (node " << from << ") and " << Pipeline_Stage_Name[link[1]] 
+			   << " (node " << to << ") are on different numa nodes" << endl;
+		}
+	}
+
+	//sharded mode: every backend pins to its slice of the lists. The CPUs are shared when there is no slice for every backend,
+	//or with the publisher of the gateway
+	if (process_shard_count > 0) {
+		set<int> publisher_cpus(stage_cpus[STAGE_PUBLISHER].begin(), stage_cpus[STAGE_PUBLISHER].end());
+
+		for (Pipeline_Stage stage : shard_backend_stages) {
+			const vector<int> & cpus = stage_cpus[stage];
+			if ( cpus.empty() ) {
+				continue;
+			}
+
+			if (cpus.size() < process_shard_count) {
+				ss << "    warning : " << Pipeline_Stage_Name[stage] << " has " << cpus.size() << " cpus for " << process_shard_count
+				   << " backends. The backends share them" << endl;
+			} else {
+				ss << "    " << setw(10) << left << Pipeline_Stage_Name[stage] << " : " << cpus.size() / process_shard_count
+				   << " to " << (cpus.size() + process_shard_count - 1) / process_shard_count << " cpus per backend" << endl;
+			}
+
+			for (int cpu : cpus) {
+				if ( publisher_cpus.count(cpu) ) {
+					ss << "    warning : " << Pipeline_Stage_Name[stage] << " shares cpu " << cpu << " with the publisher" << endl;
+				}
+			}
+		}
+	}
+
+	if (spin_wait_usecs > 0) {
+		ss << "    fsm and publisher spin for " << spin_wait_usecs << " usecs before blocking" << endl;
+	}
+
+	cout      << ss.str();
+	LOG(INFO) << ss.str();
+}
+
+
+
+//Whether a thread that last did work at last_work still spins (-w) instead of blocking
+bool spin_wait(chrono::steady_clock::time_point last_work) {
+	return spin_wait_usecs > 0 and chrono::steady_clock::now() < last_work + chrono::microseconds(spin_wait_usecs);
+}
+
+
+
+//Sharded mode: fork a backend process per partition. Each backend gets a stream socket for its bars and a seqpacket socket
+//for the interest of the gateway. Returns in the backends too, with process_shard_index set
+void fork_shard_backends() {
+
+	for (unsigned int k = 0; k < process_shard_count; k++) {
+		int bars_sv[2], control_sv[2];
+
+		if ( socketpair(AF_UNIX, SOCK_STREAM, 0, bars_sv) < 0 or socketpair(AF_UNIX, SOCK_SEQPACKET, 0, control_sv) < 0 ) {
+			cout << "Error creating the sockets of shard " << k << " : " << strerror(errno) << endl;
+			exit(1);
+		}
+
+		pid_t pid = fork();
+		if (pid < 0) {
+			cout << "Error forking shard " << k << " : " << strerror(errno) << endl;
+			exit(1);
+		}
+
+		if (pid == 0) {
+			//backend. Keep only its own end of its own sockets, and go down with the gateway
+			for (const ShardBackend & backend : shard_backends) {
+				close(backend.bars_fd);
+				close(backend.control_fd);
+			}
+			shard_backends.clear();
+			close(bars_sv[0]);
+			close(control_sv[0]);
+			prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+			process_shard_index = k;
+			pfd_w2_w3[1]        = bars_sv[1];
+			shard_control_fd    = control_sv[1];
+			return;
+		}
+
+		close(bars_sv[1]);
+		close(control_sv[1]);
+
+		ShardBackend backend;
+		backend.pid        = pid;
+		backend.bars_fd    = bars_sv[0];
+		backend.control_fd = control_sv[0];
+		shard_backends.push_back(backend);
+	}
+}
+
+
+
+//Gateway: a symbol or a glob pattern got its first subscriber (add) or lost its last one. A symbol goes to the backend that owns
+//it, a pattern to all of them. The publisher must never block on a backend, so a message that does not fit in the socket is
+//queued and sent by the publisher loop when the socket is writable again. Losing one would leave the subscribers with the
+//closing bars only, or the backend with interest nobody has any more
+void shard_route_interest(const string & key, bool add) {
+
+	if ( shard_backends.empty() ) {
+		return;
+	}
+
+	//the keys are counted by the backends, so a pattern too long for the message can stand for all the symbols
+	ShardInterestMsg msg;
+	msg.add = add ? 1 : 0;
+	const string & routed = (key.size() <= sizeof(msg.key)) ? key : string("*");
+	memcpy(msg.key, routed.data(), routed.size());
+	size_t len = offsetof(ShardInterestMsg, key) + routed.size();
+
+	bool pattern = is_symbol_pattern(routed);
+	size_t owner = pattern ? 0 : symbol_shard(routed.c_str(), shard_backends.size());
+
+	for (size_t k = 0; k < shard_backends.size(); k++) {
+		if ( (!pattern and k != owner) or shard_backends[k].bars_fd < 0 ) {
+			continue;
+		}
+
+		shard_backends[k].control_queue.push_back( string((const char *) &msg, len) );
+		shard_flush_interest(k);
+	}
+
+	LOG(INFO) << "Worker 3 (Publisher Thread) => Interest " << (add ? "added" : "removed") << " : " << routed 
+	          << " : shard " << (pattern ? string("all") : to_string(owner)) << endl;
+}
+
+
+
+//Gateway: send the queued interest messages of a backend, in order, until its control socket is full. The rest waits for the
+//socket to be writable (EPOLLOUT in the publisher loop)
+void shard_flush_interest(int shard) {
+
+	ShardBackend & backend = shard_backends[shard];
+
+	while ( !backend.control_queue.empty() and backend.control_fd >= 0 ) {
+		const string & msg = backend.control_queue.front();
+
+		if ( send(backend.control_fd, msg.data(), msg.size(), MSG_DONTWAIT | MSG_NOSIGNAL) != (ssize_t) msg.size() ) {
+			if (errno != EAGAIN and errno != EWOULDBLOCK) {
+				//the backend is gone. Its bars socket reports it
+				LOG(INFO) << "Worker 3 (Publisher Thread) => Error sending interest to shard " << shard << " : " << strerror(errno) << endl;
+				backend.control_queue.clear();
+			} else if (backend.control_queue.size() == 1) {
+				LOG(INFO) << "Worker 3 (Publisher Thread) => Control socket of shard " << shard << " is full. Queueing the interest messages" << endl;
+			}
+			return;
+		}
+		backend.control_queue.pop_front();
+	}
+}
+
+
+
+//Gateway: the bars socket of a backend reached EOF, the backend exited. Its symbols stop updating, the others go on
+void shard_backend_down(int shard) {
+
+	ShardBackend & backend = shard_backends[shard];
+
+	int status = 0;
+	string cause = "unknown";
+	if ( waitpid(backend.pid, &status, 0) == backend.pid ) {
+		cause = WIFSIGNALED(status) ? "killed by signal " + to_string(WTERMSIG(status)) : "exit status " + to_string(WEXITSTATUS(status));
+	}
+
+	close(backend.control_fd);
+	backend.bars_fd    = -1;
+	backend.control_fd = -1;
+	backend.control_queue.clear();
+
+	size_t up = 0;
+	for (const ShardBackend & b : shard_backends) {
+		up += (b.bars_fd >= 0);
+	}
+
+	stringstream ss;
+	ss << "Worker 3 (Publisher Thread) => Shard " << shard << " (pid " << backend.pid << ") is down : " << cause 
+	   << ". Its symbols stop updating. Shards up = " << up << " of " << shard_backends.size() << endl;
+	cout      << ss.str();
+	LOG(INFO) << ss.str();
+}
+
+
+
+//Whether a symbol matches the interest of the gateway
+bool shard_match_interest(const string & sym) {
+	if ( shard_interest_keys.find(sym) != shard_interest_keys.end() ) {
+		return true;
+	}
+	for (const SymbolPattern & pat : shard_interest_patterns) {
+		if ( symbol_pattern_match(pat, sym) ) {
+			return true;
+		}
+	}
+return false;
+}
+
+
+
+//Backend: read an interest message of the gateway and resolve the symbols seen so far again. false when the gateway is gone
+bool shard_read_interest() {
+
+	ShardInterestMsg msg;
+	ssize_t r = recv(shard_control_fd, &msg, sizeof(msg), 0);
+	if ( r <= (ssize_t) offsetof(ShardInterestMsg, key) ) {
+		return false;
+	}
+
+	string key(msg.key, r - offsetof(ShardInterestMsg, key));
+
+	if (msg.add) {
+		if ( shard_interest_keys[key]++ == 0 and is_symbol_pattern(key) ) {
+			shard_interest_patterns.push_back( compile_symbol_pattern(key) );
+		}
+	} else {
+		auto it = shard_interest_keys.find(key);
+		if ( it != shard_interest_keys.end() and --it->second == 0 ) {
+			shard_interest_keys.erase(it);
+			auto pit = shard_interest_patterns.begin();
+			while ( pit != shard_interest_patterns.end() and pit->glob != key ) pit++;
+			if ( pit != shard_interest_patterns.end() ) {
+				shard_interest_patterns.erase(pit);
+			}
 		}
 	}
-}
-
 
+	for (auto & entry : shard_interest_cache) {
+		entry.second = shard_match_interest(entry.first);
+	}
 
-//Fire FSM Event
-bool fsm_fire_event(FSM_EVENT & fsm_ev) {
-	process_fsm_event(fsm_ev);
+	LOG(INFO) << "Worker 2 (FSM Thread) => Interest " << (msg.add ? "added" : "removed") << " : " << key 
+	          << ", keys = " << shard_interest_keys.size() << endl;
 return true;
 }
 
-//Process events while FSM_State == FSM_STARTING. Ignore all events received at this stage
-bool process_fsm_starting(FSM_EVENT & fsm_ev) {
-
-	LOG(INFO)  << "Worker 2(FSM Thread) => event arrived. Ignoring as state = " << FSM_State_Name[fsm_curr_state] << endl;
-return true;
-}
 
-//Process events while FSM_State == FSM_DOWN. Ignore all events received at this stage
-bool process_fsm_down(FSM_EVENT & fsm_ev) {
 
-	LOG(INFO)  << "Worker 2(FSM Thread) => event arrived. Ignoring as state = " << FSM_State_Name[fsm_curr_state] << endl;
-return true;
+//Backend: whether the updates of a symbol go to the gateway. The first message of a symbol always goes, so the gateway learns
+//about the symbol right away
+bool shard_interested(const char *sym) {
+	string key(sym);
+	auto it = shard_interest_cache.find(key);
+	if ( it == shard_interest_cache.end() ) {
+		shard_interest_cache.insert( pair<string, bool>(key, shard_match_interest(key)) );
+		return true;
+	}
+return it->second;
 }
 
 
-//Process events TRADE_PKT_ARRIVAL while FSM_State == FSM_READY
-bool process_fsm_ready_ev_trd_pkt_arrival(FSM_EVENT & fsm_ev) {
-	
-	char symbol[15];
-	strcpy(symbol, fsm_ev.data.trd_pkt.sym);
-	double price = fsm_ev.data.trd_pkt.price;
-	double qty   = fsm_ev.data.trd_pkt.qty;
-	uint64_t ts2 = fsm_ev.data.trd_pkt.ts2; 
-	uint64_t expired_timestamp = ts2; 
-
-	LOG(INFO)  << "Worker 2 (FSM Thread) => event arrived = trd_pkt_arrival: sym = " << symbol << ", P = " << price << ", Q = " << qty << ", TS2 = " << ts2 << endl;
-
-	//check if symbol exists in Bar contexts cache
-	string sym(symbol);
-
-	LOG(INFO)  << "Worker 2 (FSM Thread) => Searching bar cache for symbol " << symbol << endl;
-
-	auto it = bar_cntxt_cache.find(sym);
 
-	bool cntxt_exists = (it != bar_cntxt_cache.end());
-
-	if (!cntxt_exists) {
-		//bars context does not exist. create it
-	    LOG(INFO)  << "Worker 2 (FSM Thread) => Bar context does not exist. Creating it : sym = " << symbol << endl;
-		BarCntxt newcntxt;
-		strcpy(newcntxt.sym, symbol);
-		newcntxt.bar_num        = 1;
-		newcntxt.bar_start_time = ts2;
-		newcntxt.bar_close_time = ts2 + fifteen_sec_nanosecs;
-		newcntxt.bar_open       = price;
-		newcntxt.bar_high       = price;
-		newcntxt.bar_low        = price;
-		newcntxt.bar_close      = price;
-		newcntxt.bar_volume     = qty;
-	
-		//store the new context in cache
-		bar_cntxt_cache.insert( pair<string, BarCntxt>(sym, newcntxt) );
+//Load the fixed point formats : <symbol or glob pattern> <price decimals> <volume decimals> per line
+bool load_fixed_point_formats(const char *fname) {
 
-		//TODO - update subscribers on bar open
-		fsm_emit_bar(newcntxt, TRADE_BAR);
+	ifstream fmtfile(fname);
+	if ( !fmtfile.is_open() ) {
+		return false;
 	}
-	else {
-		//bars context exist, update it
-	    LOG(INFO)  << "Worker 2 (FSM Thread) => Bar context exists. Update it : sym = " << symbol << endl;
 
-		BarCntxt oldcntxt = it->second;
+	string line;
+	while (getline(fmtfile, line)) {
+		istringstream is(line);
+		string sym;
+		FixedPointFormat fmt;
 
-	    LOG(INFO)  << "Worker 2 (FSM Thread) => sym = " << symbol << ", Current bar close time = " << oldcntxt.bar_close_time << ", Current TS2 : " << ts2 << endl;
+		if ( !(is >> sym) or sym[0] == '#' ) {
+			continue;
+		}
 
-		if ( ts2 <= oldcntxt.bar_close_time) {
-	    LOG(INFO)  << "Worker 2 (FSM Thread) => sym = " << symbol << ". Trade goes into exising bar" << endl;
+		if ( !(is >> fmt.price_decimals >> fmt.volume_decimals) or
+		     fmt.price_decimals < 0 or fmt.price_decimals > 18 or fmt.volume_decimals < 0 or fmt.volume_decimals > 18 ) {
+			LOG(INFO) << "Invalid fixed point format : " << line << endl;
+			return false;
+		}
 
-			//trade goes into existing bar
-			if (price > oldcntxt.bar_high) {
-				oldcntxt.bar_high = price;
-			}
+		fmt.pattern = compile_symbol_pattern(sym);
+		fixed_point_formats.push_back(fmt);
+	}
+return true;
+}
 
-			if (price < oldcntxt.bar_low ) {
-				oldcntxt.bar_low  = price;
-			}
 
-			oldcntxt.bar_close    = price;
-			oldcntxt.bar_volume  += qty;
-			it->second = oldcntxt;
-		
-		//TODO - update subscribers on trade update
-		fsm_emit_bar(oldcntxt, TRADE_BAR);
-		}
-		else {
-			    //trade goes into next bar or someother future bar
-	    		LOG(INFO)  << "Worker 2 (FSM Thread) => sym = " << symbol << ". Trade goes into next bar or future bar" << endl;
-				uint64_t curr_bar_close_time = oldcntxt.bar_close_time;
-				do {
-					// keep closing the current bar until the bar that accomodates the current trade opens up
-					BarCntxt newcntxt;
-					strcpy(newcntxt.sym, symbol);
-					newcntxt.bar_num        = oldcntxt.bar_num + 1;
-					newcntxt.bar_start_time = oldcntxt.bar_close_time + 1;
-					newcntxt.bar_close_time = newcntxt.bar_start_time + fifteen_sec_nanosecs;
-					newcntxt.bar_open       = oldcntxt.bar_close;
-					newcntxt.bar_high       = oldcntxt.bar_close;
-					newcntxt.bar_low        = oldcntxt.bar_close;
-					newcntxt.bar_close      = oldcntxt.bar_close;
-					newcntxt.bar_volume     = 0;
-
-					//emit closing bar info to worker 3 
-					fsm_emit_bar(oldcntxt, CLOSING_BAR);
-
-					//update the bar cache with current bar info
-					it->second = newcntxt;
-					curr_bar_close_time = newcntxt.bar_close_time;
-					oldcntxt = newcntxt;
-
-				} while (ts2 > curr_bar_close_time ); 
-				
-				//the intermediate bars have been closed. update the current bar with current trade info
-				oldcntxt.bar_open     = price;
-				oldcntxt.bar_high     = price;
-				oldcntxt.bar_low      = price;
-				oldcntxt.bar_close    = price;
-				oldcntxt.bar_volume  += qty;
-				it->second = oldcntxt;
 
-				//TODO - update subscribers on trade update
-				fsm_emit_bar(oldcntxt, TRADE_BAR);
+//Fixed point format of a symbol : the first format whose pattern matches. NULL if none
+const FixedPointFormat *fixed_point_format(const string & sym) {
+	for (const FixedPointFormat & fmt : fixed_point_formats) {
+		if ( symbol_pattern_match(fmt.pattern, sym) ) {
+			return &fmt;
 		}
 	}
+return NULL;
+}
 
-	//Create a timer expiry event for the currently processed UTC timestamp. Let's all progress together, bring others along
 
-	//Ideally there should be a timer expiry event triggered by the system every few microseconds. But we don't have time for that
-	//when we try to replay the existing trades and build bars for existing trades. May be in future we can make all three threads
-	//react to a single underlying timer that emits timer expiry events that becomes the blood flow of the system and triggers
-	//time-scynced processing everywhere.
 
-	//This timer-expiry will hook along the processing in other tickers as well
-	FSM_EVENT fsm_tmr_ev;
-	fsm_tmr_ev.type = TIMER_EXPIRY;
-	fsm_tmr_ev.data.tmr_exp.ts = expired_timestamp;
-	fsm_fire_event(fsm_tmr_ev);
+//Writers of the serializer. Each appends at p and returns the new end. There is no bounds checking, the buffer is big enough
+//for the longest message
 
-return true;
+template <size_t N>
+inline char *ser_literal(char *p, const char (&str)[N]) {
+	memcpy(p, str, N - 1);
+return p + N - 1;
 }
 
+inline char *ser_string(char *p, const char *str) {
+	size_t len = strlen(str);
+	memcpy(p, str, len);
+return p + len;
+}
 
+inline char *ser_uint(char *p, uint64_t v) {
+return to_chars(p, p + 20, v).ptr;
+}
 
+//shortest digits that read back as the same double. JSON has no NaN / infinity
+inline char *ser_double(char *p, double v) {
+	if ( !isfinite(v) ) {
+		return ser_literal(p, "null");
+	}
+return to_chars(p, p + 32, v).ptr;
+}
 
-//Process events TIMER_EXPIRY while FSM_State == FSM_READY
-bool process_fsm_ready_ev_tmr_expiry(FSM_EVENT & fsm_ev) {
-	uint64_t expired_ts = fsm_ev.data.tmr_exp.ts; 
-	LOG(INFO)  << "Worker 2 (FSM Thread) => event arrived = timer_expiry: " << "TS = " << expired_ts << endl;
-
-	//Iterate the bar cache and close the bars that have expired
-	for( auto it = bar_cntxt_cache.begin() ; it != bar_cntxt_cache.end() ; it++ ) {
-		string   sym       = it->first;
-		BarCntxt barcntxt  = it->second;
-		uint64_t bar_close_time = barcntxt.bar_close_time; 
-		LOG(INFO)  << "Worker 2 (FSM Thread) => processing timer_expiry: " << "symbol = " << sym << ", bar_close_time = " << bar_close_time << ", expired_ts = " << expired_ts << endl;
-
-	 while (expired_ts > bar_close_time ) {
-
-			// keep closing the current bar until the bar that accomodates the current expired timestamp opens up
-			BarCntxt newcntxt;
-			strcpy(newcntxt.sym, barcntxt.sym);
-			newcntxt.bar_num        = barcntxt.bar_num + 1;
-			newcntxt.bar_start_time = barcntxt.bar_close_time + 1;
-			newcntxt.bar_close_time = newcntxt.bar_start_time + fifteen_sec_nanosecs;
-			newcntxt.bar_open       = barcntxt.bar_close;
-			newcntxt.bar_high       = barcntxt.bar_close;
-			newcntxt.bar_low        = barcntxt.bar_close;
-			newcntxt.bar_close      = barcntxt.bar_close;
-			newcntxt.bar_volume     = 0;
+//v rounded to decimals digits after the point, formatted as an integer scaled by 10^decimals. A negative decimals is the
+//shortest round trip format
+inline char *ser_number(char *p, double v, int decimals) {
+	static const uint64_t pow10[19] = { 1UL, 10UL, 100UL, 1000UL, 10000UL, 100000UL, 1000000UL, 10000000UL, 100000000UL,
+	                                    1000000000UL, 10000000000UL, 100000000000UL, 1000000000000UL, 10000000000000UL,
+	                                    100000000000000UL, 1000000000000000UL, 10000000000000000UL, 100000000000000000UL,
+	                                    1000000000000000000UL };
+	if (decimals < 0) {
+		return ser_double(p, v);
+	}
 
-			//emit closing bar info to worker 3 
-			fsm_emit_bar(barcntxt, TIMER_EXP_CLOSING_BAR);
+	double scaled = v * (double) pow10[decimals];
+	if ( !(fabs(scaled) < 9.0e18) ) {
+		//does not fit the fixed point representation
+		return ser_double(p, v);
+	}
 
-			//emit opening bar info to worker 3. (do not emit opening bars, emit bars only on closure of bars or trades)
-			//fsm_emit_bar(newcntxt, TIMER_EXP_OPENING_BAR);
+	int64_t mantissa = llround(scaled);
+	if (mantissa < 0) {
+		*p++ = '-';
+		mantissa = -mantissa;
+	}
 
-			//update the bar cache with current bar info
-			it->second = newcntxt;
-			bar_close_time = newcntxt.bar_close_time;
-			barcntxt = newcntxt;
+	p = ser_uint(p, (uint64_t) mantissa / pow10[decimals]);
+	if (decimals > 0) {
+		uint64_t frac = (uint64_t) mantissa % pow10[decimals];
+		*p++ = '.';
+		for (int i = decimals - 1; i >= 0; i--) {
+			p[i] = '0' + frac % 10;
+			frac /= 10;
 		}
-	} 
-return true;
+		p += decimals;
+	}
+return p;
 }
 
 
 
-//Process FSM Event - Demulitplex based on the fsm_curr_state and event type
-bool process_fsm_event(FSM_EVENT & fsm_ev) {
-	FSM_Event_Types ev_type = fsm_ev.type;	
-	//LOG(INFO)  << "FSM Thread => dispatching event " << FSM_Event_Type_Name[ev_type] << " to handler function" << endl; 
-	(*FSM_Ev_Handler_Table[fsm_curr_state][ev_type])(fsm_ev);
-
-return true;
+//Serialize a bar message as ohlc_notify, or ohlc_gap for a run of empty bars, into buf. Returns the length. Does not allocate
+size_t serialize_bar(const BarMsg & barmsg, const FixedPointFormat *fmt, char *buf) {
+
+	const BarCntxt & bar = barmsg.bar;
+	int price_decimals  = (fmt != NULL) ? fmt->price_decimals  : -1;
+	int volume_decimals = (fmt != NULL) ? fmt->volume_decimals : -1;
+
+	char *p = buf;
+	if (barmsg.type == EMPTY_BARS_GAP) {
+		//a run of empty bars. clients expand it into gap_bars bars with O = H = L = C = price and volume 0
+		p = ser_literal(p, "{\"event\": \"ohlc_gap\", \"symbol\": \"");
+		p = ser_string(p, bar.sym);
+		p = ser_literal(p, "\", \"from_bar_num\": ");
+		p = ser_uint(p, bar.bar_num);
+		p = ser_literal(p, ", \"to_bar_num\": ");
+		p = ser_uint(p, (uint64_t) bar.bar_num + barmsg.gap_bars - 1);
+		p = ser_literal(p, ", \"count\": ");
+		p = ser_uint(p, barmsg.gap_bars);
+		p = ser_literal(p, ", \"price\": ");
+		p = ser_number(p, bar.bar_close, price_decimals);
+		p = ser_literal(p, "}");
+	} else {
+		p = ser_literal(p, "{\"event\": \"ohlc_notify\", \"symbol\": \"");
+		p = ser_string(p, bar.sym);
+		p = ser_literal(p, "\", \"bar_num\": ");
+		p = ser_uint(p, bar.bar_num);
+		p = ser_literal(p, ", \"O\": ");
+		p = ser_number(p, bar.bar_open, price_decimals);
+		p = ser_literal(p, ", \"H\": ");
+		p = ser_number(p, bar.bar_high, price_decimals);
+		p = ser_literal(p, ", \"L\": ");
+		p = ser_number(p, bar.bar_low, price_decimals);
+		p = ser_literal(p, ", \"C\": ");
+		p = ser_number(p, bar.bar_close, price_decimals);
+		p = ser_literal(p, ", \"volume\": ");
+		p = ser_number(p, bar.bar_volume, volume_decimals);
+		p = ser_literal(p, "}");
+	}
+return p - buf;
 }
 
 
 
-//Emit bar into to worker 3
-bool fsm_emit_bar(BarCntxt barcntxt, Bar_Type bt){
+//Serialize a footprint message into buf. Only the price levels with volume are written. Returns the length
+size_t serialize_footprint(const FootprintMsg & fpmsg, const FixedPointFormat *fmt, char *buf) {
 
-	//closing price is 0.0 for bars that are not closing bars. i.e trade bars / open bars etc
-	//actual closing price is emited only for bar types CLOSING_BAR and TIMER_EXP_CLOSING_BAR
+	int price_decimals  = (fmt != NULL) ? fmt->price_decimals  : -1;
+	int volume_decimals = (fmt != NULL) ? fmt->volume_decimals : -1;
 
-	if (bt == TRADE_BAR or bt == TIMER_EXP_OPENING_BAR) {
-		barcntxt.bar_close = 0.0;
+	char *p = buf;
+	p = ser_literal(p, "{\"event\": \"footprint\", \"symbol\": \"");
+	p = ser_string(p, fpmsg.sym);
+	p = ser_literal(p, "\", \"bar_num\": ");
+	p = ser_uint(p, fpmsg.bar_num);
+	p = (fpmsg.type == FOOTPRINT_CLOSED) ? ser_literal(p, ", \"closed\": true") : ser_literal(p, ", \"closed\": false");
+	p = ser_literal(p, ", \"level_width\": ");
+	p = ser_double(p, fpmsg.width);
+	p = ser_literal(p, ", \"levels\": [");
+
+	bool first = true;
+	for (int b = fpmsg.lo; b <= fpmsg.hi; b++) {
+		if (fpmsg.volume[b] == 0) {
+			continue;
+		}
+		p = first ? ser_literal(p, "[") : ser_literal(p, ", [");
+		p = ser_number(p, fpmsg.base + b * fpmsg.width, price_decimals);
+		p = ser_literal(p, ", ");
+		p = ser_number(p, fpmsg.volume[b], volume_decimals);
+		p = ser_literal(p, ", ");
+		p = ser_number(p, fpmsg.buy[b], volume_decimals);
+		p = ser_literal(p, ", ");
+		p = ser_number(p, fpmsg.sell[b], volume_decimals);
+		p = ser_literal(p, "]");
+		first = false;
 	}
+	p = ser_literal(p, "]}");
+return p - buf;
+}
 
-	char symbol[15];
-	unsigned int bar_num   = barcntxt.bar_num;
-	double bar_open        = barcntxt.bar_open;
-	double bar_high        = barcntxt.bar_high;
-	double bar_low         = barcntxt.bar_low;
-	double bar_close       = barcntxt.bar_close;
-	double bar_volume      = barcntxt.bar_volume;
-	uint64_t bar_start_time  = barcntxt.bar_start_time;
-	uint64_t bar_close_time  = barcntxt.bar_close_time;
-	strcpy(symbol, barcntxt.sym);
 
-	string sym(symbol);
 
-	bool emit_bar = true;
+//Serializer microbenchmark. Formats ohlc_notify messages of a low priced pair with the stringstream formatting the publisher
+//used before the serializer, with the serializer, and with the serializer in fixed point. Reports messages/sec of each
+void serializer_benchmark(unsigned long num_msgs) {
 
-	//check if bar exists in outboud cache. emit the bar only in case of new bars / update of existing bars
-	auto it = outbound_cache.find(sym);
-	bool bar_exists = (it != outbound_cache.end());
+	BarMsg barmsg;
+	memset(&barmsg, 0, sizeof(barmsg));
+	barmsg.type = CLOSING_BAR;
+	strcpy(barmsg.bar.sym, "ADAXBT");
+	barmsg.bar.bar_num    = 7443;
+	barmsg.bar.bar_open   = 1.2317093740000001e-05;
+	barmsg.bar.bar_high   = 1.2335e-05;
+	barmsg.bar.bar_low    = 1.2301e-05;
+	barmsg.bar.bar_close  = 1.2326e-05;
+	barmsg.bar.bar_volume = 9374.0912345;
 
-	if ( bar_exists == true ) {
-		BarCntxt prevctxt = it->second;
-	
-		if ( bar_num        == prevctxt.bar_num        and
-		     bar_open       == prevctxt.bar_open       and
-		     bar_high       == prevctxt.bar_high       and
-		     bar_low        == prevctxt.bar_low        and
-		     bar_close      == prevctxt.bar_close      and
-		     bar_volume     == prevctxt.bar_volume     and
-		     bar_start_time == prevctxt.bar_start_time and
-		     bar_close_time == prevctxt.bar_close_time ) {
-			//the bar need not be emitted if the values have not changed
-			emit_bar = false;
-			LOG(INFO)  << "Worker 2 (FSM Thread) => Ignoring bar. No update in existing bar. " << "bartype = " << Bar_Type_Name[bt] 
-                 << ", symbol = " << symbol 
-                 << ", bar_num = " << bar_num << endl;
-		}
+	FixedPointFormat fixed;
+	fixed.pattern         = compile_symbol_pattern("ADAXBT");
+	fixed.price_decimals  = 10;
+	fixed.volume_decimals = 8;
+
+	size_t bytes = 0;
+
+	auto start = chrono::steady_clock::now();
+	for (unsigned long i = 0; i < num_msgs; i++) {
+		barmsg.bar.bar_num++;
+		const BarCntxt & bar = barmsg.bar;
+		stringstream ss;
+		ss << "{\"event\": \"ohlc_notify\", ";
+		ss << "\"symbol\": \"" << bar.sym       << "\", ";
+		ss << "\"bar_num\": "  << bar.bar_num   << ", ";
+		ss << "\"O\": "        << bar.bar_open  << ", ";
+		ss << "\"H\": "        << bar.bar_high  << ", ";
+		ss << "\"L\": "        << bar.bar_low   << ", ";
+		ss << "\"C\": "        << bar.bar_close << ", ";
+		ss << "\"volume\": "   << bar.bar_volume;
+		ss << "}";
+		bytes += ss.str().size();
 	}
+	double stringstream_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-	if (emit_bar == true) {
-		if (bar_exists == true) {
-			//update existing entry in the outbound cache
-			it->second = barcntxt;
-		} else {
-			//insert new entry in the outbound cache
-			outbound_cache.insert( pair<string, BarCntxt>(sym, barcntxt) );
-		}
-		LOG(INFO)  << "Worker 2 (FSM Thread) => Emiting Bar : " 
-		             << "bartype = "          << Bar_Type_Name[bt] 
-		             << ", symbol = "         << symbol 
-		             << ", bar_num = "        << bar_num
-		             << ", O = "              << bar_open
-		             << ", H = "              << bar_high
-		             << ", L = "              << bar_low
-		             << ", C = "              << bar_close
-		             << ", volume = "         << bar_volume
-		             << ", bar_start_time = " << bar_start_time
-		             << ", bar_close_time = " << bar_close_time
-		             << endl;
+	start = chrono::steady_clock::now();
+	for (unsigned long i = 0; i < num_msgs; i++) {
+		barmsg.bar.bar_num++;
+		bytes += serialize_bar(barmsg, NULL, serializer_buf);
+	}
+	double shortest_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
-		//write bar context into the pipe that takes the data to publisher thread
-		write(pfd_w2_w3[1], &barcntxt, sizeof(barcntxt));
+	start = chrono::steady_clock::now();
+	for (unsigned long i = 0; i < num_msgs; i++) {
+		barmsg.bar.bar_num++;
+		bytes += serialize_bar(barmsg, &fixed, serializer_buf);
 	}
+	double fixed_secs = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+	cout << "Serializer benchmark : " << num_msgs << " ohlc_notify messages. messages/sec : stringstream = " << (uint64_t) (num_msgs / stringstream_secs)
+	     << ", serializer = " << (uint64_t) (num_msgs / shortest_secs)
+	     << ", serializer fixed point = " << (uint64_t) (num_msgs / fixed_secs) << endl;
+	cout << "    stringstream : " << barmsg.bar.sym << " O = " << barmsg.bar.bar_open << endl;
+	cout << "    serializer   : " << string(serializer_buf, serialize_bar(barmsg, NULL, serializer_buf)) << endl;
+	cout << "    fixed point  : " << string(serializer_buf, serialize_bar(barmsg, &fixed, serializer_buf)) << endl;
+	LOG(INFO) << "Serializer benchmark : " << num_msgs << " messages, " << bytes << " bytes" << endl;
 }
 
 
 
-
 //Seasocks websockets libray handlers client side service
 
 class MyHandler : public WebSocket::Handler {
@@ -781,8 +4585,7 @@ public:
 
         _connections.insert(connection);
 		//initialize subscriptions for the connection
-		std::set<string> emptyset;
-		_client_subscriptions.insert( pair< WebSocket*, std::set<string> >(connection, emptyset) );
+		_client_subscriptions.insert( pair< WebSocket*, ClientSubscriptions >(connection, ClientSubscriptions()) );
 
 		ss.clear();
         ss << "Worker 3 (Publisher Thread) => Created empty subscription list for : " << formatAddress(connection->getRemoteAddress()) << endl;
@@ -808,58 +4611,73 @@ public:
             return;
         }
 
-        string indata = string(data);
-
-		//insert the subscription into subscription list
-		std::map<string, string> submsg;
-
-		parse_subscription(indata, submsg);
-		string event;
-		string ticker;
-		string interval;
-	
-		auto it = submsg.find("event");
-		if ( it != submsg.end() ) {
-			event = it->second;
-		}
-
-		if ( (it = submsg.find("symbol")) != submsg.end() ) {
-			ticker = it->second;
-		}
+		//parse the subscription request. symbols can be single symbols, arrays and glob patterns
+		SubscriptionRequest req;
 
-		if ( (it = submsg.find("interval")) != submsg.end() ) {
-			interval = it->second;
+		if ( !parse_subscription(data, req) ) {
+			LOG(INFO) << "Worker 3 (Publisher Thread) => Invalid subscription message : " << data << endl;
+			connection->send("Invalid subscription message");
+			return;
 		}
 
 		stringstream ss;
-		ss   << "Worker 3 (Publisher Thread) => event = " << event
-		     << ", symbol = " << ticker
-		     << ", interval = " << interval << endl;
+		ss   << "Worker 3 (Publisher Thread) => event = " << req.event
+		     << ", symbols = " << req.symbols.size();
+		for (const string & ticker : req.symbols) {
+			ss << " " << ticker;
+		}
+		ss   << ", interval = " << req.interval << endl;
 
 		cout      << ss.str();
 		LOG(INFO) << ss.str();
 
-		if (event == "subscribe") {
-			auto it = _client_subscriptions.find(connection);
-			if ( it != _client_subscriptions.end()) {
-				auto subset = it->second;
-				subset.insert(ticker);
-				it->second = subset;
-			}
+		auto itc = _client_subscriptions.find(connection);
+		if ( itc == _client_subscriptions.end() ) {
+			return;
 		}
+		ClientSubscriptions & subs = itc->second;
+
+		if (req.event == "subscribe" or req.event == "unsubscribe") {
+			bool subscribe = (req.event == "subscribe");
+
+			for (const string & ticker : req.symbols) {
+				if ( is_symbol_pattern(ticker) ) {
+					SymbolPattern pat = compile_symbol_pattern(ticker);
+					auto pit = subs.patterns.begin();
+					while ( pit != subs.patterns.end() and pit->glob != pat.glob ) pit++;
+
+					if (subscribe and pit == subs.patterns.end()) {
+						subs.patterns.push_back(pat);
+						addInterest(pat.glob);
+					} else if (!subscribe and pit != subs.patterns.end()) {
+						subs.patterns.erase(pit);
+						removeInterest(pat.glob);
+					}
+				} else if (subscribe) {
+					if ( subs.symbols.insert(ticker).second ) {
+						addInterest(ticker);
+					}
+				} else {
+					if ( subs.symbols.erase(ticker) ) {
+						removeInterest(ticker);
+					}
+				}
+			}
 
-		string msg    = "";
-		//send back the subscribied tickers to client
-		auto itc = _client_subscriptions.find(connection);
+			//resolve the changed subscriptions against the symbols seen so far
+			resolveSubscriptions(connection, subs);
+		}
 
-		if ( itc != _client_subscriptions.end()) {
-				auto subset = itc->second;
-				for (auto subticker : subset) {
-					msg = msg + subticker + " ";
-				}
+		//send back the subscribied tickers and patterns to client
+		string msg = "Hello client! your current subscriptions : ";
+		for (const string & subticker : subs.symbols) {
+			msg += subticker;
+			msg += ' ';
+		}
+		for (const SymbolPattern & pat : subs.patterns) {
+			msg += pat.glob;
+			msg += ' ';
 		}
-		
-		msg = "Hello client! your current subscriptions : " + msg;
         connection->send(msg.c_str());
     }
 
@@ -874,7 +4692,21 @@ public:
 		cout      << ss.str();
 		LOG(INFO) << ss.str();
 
-		_client_subscriptions.erase(connection);
+		auto itc = _client_subscriptions.find(connection);
+		if ( itc != _client_subscriptions.end() ) {
+			for (const string & ticker : itc->second.symbols) {
+				removeInterest(ticker);
+			}
+			for (const SymbolPattern & pat : itc->second.patterns) {
+				removeInterest(pat.glob);
+			}
+			_client_subscriptions.erase(itc);
+		}
+
+		for (auto & entry : _symbol_subscribers) {
+			vector<WebSocket*> & subscribers = entry.second;
+			subscribers.erase( remove(subscribers.begin(), subscribers.end(), connection), subscribers.end() );
+		}
 		
 		ss.clear();
 
@@ -885,67 +4717,324 @@ public:
 
     }
 
-    void publishBar(BarCntxt barcntxt) {
+    void publishBar(const BarMsg & barmsg) {
 
+		const BarCntxt & barcntxt = barmsg.bar;
 		string ticker(barcntxt.sym);
 
+		const vector<WebSocket*> & subscribers = subscribersOf(ticker);
+		if ( subscribers.empty() ) {
+			return;
+		}
+
+		size_t len = serialize_bar(barmsg, formatOf(ticker), serializer_buf);
+
+		for (auto connection : subscribers) {
+			queueMessage(connection, serializer_buf, len);
+		}
+    }
+
+    //Send the footprint of a bar to the subscribers of the symbol. Only the price levels with volume are sent, price is the
+    //lower price of the level. Volume that is neither buy nor sell (no tick rule side yet) is in volume only
+    void publishFootprint(const FootprintMsg & fpmsg) {
+
+		string ticker(fpmsg.sym);
+
+		const vector<WebSocket*> & subscribers = subscribersOf(ticker);
+		if ( subscribers.empty() ) {
+			return;
+		}
+
+		size_t len = serialize_footprint(fpmsg, formatOf(ticker), serializer_buf);
+
+		for (auto connection : subscribers) {
+			queueMessage(connection, serializer_buf, len);
+		}
+	}
+
+    //Send the messages queued for every connection in this drain cycle of the bars pipe. A single message goes out as it is,
+    //several as one JSON array frame
+    void flushFrames() {
+		for (WebSocket* connection : _pending_connections) {
+			auto itc = _client_subscriptions.find(connection);
+			if ( itc == _client_subscriptions.end() ) {
+				continue;
+			}
+			ClientSubscriptions & subs = itc->second;
+
+			if (subs.pending_msgs > 1) {
+				subs.pending.insert(0, 1, '[');
+				subs.pending += ']';
+			}
+
+			LOG(INFO) << "Worker 3 (Publisher Thread) => Sending frame to client : " << formatAddress(connection->getRemoteAddress()) 
+			          << " : messages = " << subs.pending_msgs << ", bytes = " << subs.pending.size() << endl;
+
+			connection->send(subs.pending);
+
+			_stats.frames++;
+			_stats.frame_bytes += subs.pending.size();
+
+			subs.pending.clear();
+			subs.pending_msgs = 0;
+		}
+		_pending_connections.clear();
+	}
+
+    //Report the messages (one per bar per subscriber, the frames sent without coalescing) and the frames actually sent since
+    //the last report. Bytes are before permessage-deflate
+    void reportStats(double secs) {
 		stringstream ss;
+		ss << "Worker 3 (Publisher Thread) => messages/sec = " << _stats.messages / secs << ", message bytes/sec = " << _stats.message_bytes / secs
+		   << ", frames/sec = " << _stats.frames / secs << ", frame bytes/sec = " << _stats.frame_bytes / secs
+		   << ", messages per frame = " << (_stats.frames ? (double) _stats.messages / _stats.frames : 0.0) << endl;
 
-		ss << "{\"event\": \"ohlc_notify\", ";
-		ss << "\"symbol\": \"" << barcntxt.sym       << "\", ";
-		ss << "\"bar_num\": "  << barcntxt.bar_num   << ", ";
-		ss << "\"O\": "        << barcntxt.bar_open  << ", ";
-		ss << "\"H\": "        << barcntxt.bar_high  << ", ";
-		ss << "\"L\": "        << barcntxt.bar_low   << ", ";
-		ss << "\"C\": "        << barcntxt.bar_close << ", ";
-		ss << "\"volume\": "   << barcntxt.bar_volume;
-		ss << "}";
+		cout      << ss.str();
+		LOG(INFO) << ss.str();
+
+		_stats = PublisherStats();
+	}
+
+    //The FSM evicted an idle symbol. Its subscribers are resolved again from the subscriptions if the symbol comes back.
+    //Explicit subscriptions of the connections are kept, the clients asked for the symbol
+    void evictSymbol(const string & ticker) {
+		_symbol_subscribers.erase(ticker);
+	}
+
+private:
 
-		for (auto connection : _connections) {
+	//Subscriptions of a connection : explicitly subscribed symbols and glob patterns
+	struct ClientSubscriptions {
+		std::set<string>      symbols;
+		vector<SymbolPattern> patterns;
+
+		string                pending;        //messages queued for the next frame, comma separated
+		size_t                pending_msgs = 0;
+	};
+
+	//Counters of the messages and frames sent to the clients
+	struct PublisherStats {
+		uint64_t messages      = 0;
+		uint64_t message_bytes = 0;
+		uint64_t frames        = 0;
+		uint64_t frame_bytes   = 0;
+	};
+
+    //Fixed point format of the symbol, resolved once per symbol. NULL for the shortest round trip digits
+    const FixedPointFormat *formatOf(const string & ticker) {
+		if ( fixed_point_formats.empty() ) {
+			return NULL;
+		}
+		auto it = _symbol_formats.find(ticker);
+		if ( it == _symbol_formats.end() ) {
+			it = _symbol_formats.insert( pair<string, const FixedPointFormat*>(ticker, fixed_point_format(ticker)) ).first;
+		}
+		return it->second;
+	}
+
+    //Queue a message for the next frame of the connection
+    void queueMessage(WebSocket* connection, const char *msg, size_t len) {
+		auto itc = _client_subscriptions.find(connection);
+		if ( itc == _client_subscriptions.end() ) {
+			return;
+		}
+		ClientSubscriptions & subs = itc->second;
 
-			auto it = _client_subscriptions.find(connection);
+		if (subs.pending_msgs == 0) {
+			_pending_connections.push_back(connection);
+		} else {
+			subs.pending += ", ";
+		}
+		subs.pending.append(msg, len);
+		subs.pending_msgs++;
 
-			if ( it != _client_subscriptions.end()) {
-				auto subset = it->second;
+		_stats.messages++;
+		_stats.message_bytes += len;
+	}
 
-				if (subset.find(ticker) != subset.end()) {
+    //Count the connections subscribed to a symbol or a pattern. In the sharded mode the backends hear about the first subscriber
+    //and the last one
+    void addInterest(const string & key) {
+		if ( ++_interest_refs[key] == 1 ) {
+			shard_route_interest(key, true);
+		}
+	}
 
-					stringstream ss2;
-        			ss2       << "Worker 3 (Publisher Thread) => Sending bar to client : " << formatAddress(connection->getRemoteAddress()) 
-                  	          << " : " << ss.str()
-					          << "\n";
+    void removeInterest(const string & key) {
+		auto it = _interest_refs.find(key);
+		if ( it != _interest_refs.end() and --it->second == 0 ) {
+			_interest_refs.erase(it);
+			shard_route_interest(key, false);
+		}
+	}
 
-					cout      << ss2.str();
-					LOG(INFO) << ss2.str();
+    bool isSubscribed(const ClientSubscriptions & subs, const string & ticker) {
+		if ( subs.symbols.find(ticker) != subs.symbols.end() ) {
+			return true;
+		}
+		for (const SymbolPattern & pat : subs.patterns) {
+			if ( symbol_pattern_match(pat, ticker) ) {
+				return true;
+			}
+		}
+		return false;
+	}
 
-					connection->send(ss.str());
+	//Subscribers of the symbol. The first message of a symbol resolves it against the subscriptions of all the connections once
+    const vector<WebSocket*> & subscribersOf(const string & ticker) {
+		auto it = _symbol_subscribers.find(ticker);
+		if ( it == _symbol_subscribers.end() ) {
+			it = _symbol_subscribers.insert( pair< string, vector<WebSocket*> >(ticker, vector<WebSocket*>()) ).first;
+			for (auto & client : _client_subscriptions) {
+				if ( isSubscribed(client.second, ticker) ) {
+					it->second.push_back(client.first);
 				}
 			}
 		}
-    }
+		return it->second;
+	}
+
+	//Update the subscribers of every symbol seen so far for the current subscriptions of the connection
+    void resolveSubscriptions(WebSocket* connection, const ClientSubscriptions & subs) {
+		for (auto & entry : _symbol_subscribers) {
+			vector<WebSocket*> & subscribers = entry.second;
+			auto pos = find(subscribers.begin(), subscribers.end(), connection);
+			bool subscribed = isSubscribed(subs, entry.first);
+
+			if ( subscribed and pos == subscribers.end() ) {
+				subscribers.push_back(connection);
+			} else if ( !subscribed and pos != subscribers.end() ) {
+				subscribers.erase(pos);
+			}
+		}
+	}
 
-private:
     std::set<WebSocket*> _connections;
     Server* _server;
-	std::map<WebSocket*, std::set<string> > _client_subscriptions;
+	std::map<WebSocket*, ClientSubscriptions> _client_subscriptions;
+
+	//Resolved fanout : symbol -> connections subscribed to it explicitly or thru a pattern
+	std::map<string, vector<WebSocket*> > _symbol_subscribers;
+
+	//Connections with messages queued in the current drain cycle
+	vector<WebSocket*> _pending_connections;
+
+	//Resolved fixed point formats : symbol -> format, NULL if none matches
+	std::map<string, const FixedPointFormat*> _symbol_formats;
+
+	//Subscribed symbols and patterns -> connections subscribed to them
+	std::map<string, unsigned int> _interest_refs;
+
+	PublisherStats _stats;
 };
 
 
 
 
+//Read a bounded batch of bars from an inbound stream and hand them to the handler. The batch is a byte buffer parsed by message
+//type, since messages have different sizes (bars, footprints). A stream at EOF is a backend that went down
+void publisher_read_bars(BarInbound & in, int epfd, MyHandler & handler) {
+
+	alignas(BarMsg) static char bars[publisher_max_bars * sizeof(BarMsg)];
+
+	memcpy(bars, in.carry_buf, in.carry);
+	ssize_t r = read(in.fd, bars + in.carry, sizeof(bars) - in.carry);
+
+	if (r == 0 and in.shard >= 0) {
+		epoll_ctl(epfd, EPOLL_CTL_DEL, in.fd, NULL);
+		close(in.fd);
+		in.fd      = -1;
+		in.pending = false;
+		shard_backend_down(in.shard);
+		return;
+	}
+
+	if (r <= 0) {
+		//drained (EAGAIN) until the next edge
+		in.pending = false;
+		return;
+	}
+
+	size_t bytes = in.carry + r;
+	size_t off = 0;
+
+	//a full batch means there may be more bars in the stream
+	in.pending = ( (size_t) r == sizeof(bars) - in.carry );
+
+	while (bytes - off >= sizeof(Bar_Type)) {
+		Bar_Type type;
+		memcpy(&type, bars + off, sizeof(type));
+
+		size_t len = bar_msg_size(type);
+		if (bytes - off < len) {
+			break;
+		}
+		in.messages++;
+
+		if (type == FOOTPRINT_UPDATE or type == FOOTPRINT_CLOSED) {
+			FootprintMsg fpmsg;
+			memcpy(&fpmsg, bars + off, sizeof(fpmsg));
+			off += len;
+
+			handler.publishFootprint(fpmsg);
+			continue;
+		}
+
+		BarMsg barmsg;
+		memcpy(&barmsg, bars + off, sizeof(barmsg));
+		off += len;
+
+		if (barmsg.type == SYMBOL_EVICTED) {
+			//the FSM dropped the idle symbol. drop its cached bar and resolved subscribers too
+			pubs_bar_cache.erase(barmsg.bar.sym);
+			handler.evictSymbol(barmsg.bar.sym);
+			continue;
+		}
+
+		//the publishers bar cache holds the latest bar. For a gap that is the last of the empty bars
+		BarCntxt barcntxt = barmsg.bar;
+		if (barmsg.type == EMPTY_BARS_GAP) {
+			barcntxt.bar_num        += barmsg.gap_bars - 1;
+			barcntxt.bar_start_time += (barmsg.gap_bars - 1) * bar_period_nanosecs;
+			barcntxt.bar_close_time += (barmsg.gap_bars - 1) * bar_period_nanosecs;
+		}
+
+		string symbol(barcntxt.sym);
+		//update the publishers bar cache
+		auto it = pubs_bar_cache.find(symbol);
+		bool bar_exists = ( it != pubs_bar_cache.end() );
+
+		if (bar_exists == true) {
+			//update existing entry in the publisher cache
+			it->second = barcntxt;
+		} else {
+			//insert new entry in the publisher cache
+			pubs_bar_cache.insert( pair<string, BarCntxt>(symbol, barcntxt) );
+		}
+
+		//local readers get the bar thru the shared memory table
+		shm_bar_table_update(barmsg);
+
+		//Check the subscriptions and push the bar to subscribers thru appopriate client connection socket descriptors
+		handler.publishBar(barmsg);
+	}
+
+	in.carry = bytes - off;
+	memcpy(in.carry_buf, bars + off, in.carry);
+}
+
+
+
 //Thread 3: Websocket Publisher thread. Receive bars from FSM thread and publish to clients.
 //Maintains websocket client connections and subscriptions
 
+//The bar pipe and the seasocks server fd are watched with an edge triggered epoll. The server is serviced without blocking and the
+//bars are drained at most publisher_max_bars at a time, so neither side can hold up the other for long. Work left over
+//at the end of an iteration (bars still in the pipe, server still readable) is picked up in the next iteration without sleeping
+//In the sharded mode the bars come from the sockets of all the backends instead of the pipe, a batch from each per iteration
 void *publisher_thread_publish_bars(void *msg)
 {
-	const  int numfds =2;
-	struct pollfd fds[numfds];
-
-
-	//register pipe for incoming data activity
-	fds[0].fd = pfd_w2_w3[0];
-	fds[0].events = POLLIN;
-	BarCntxt barcntxt;
+	stage_thread_start(STAGE_PUBLISHER, "publisher");
 
 	LOG(INFO)  << "Worker 3 (Publisher Thread) => Starting Seasocks server" << endl;
 	cout       << "Worker 3 (Publisher Thread) => Starting Seasocks server" << endl;
@@ -957,73 +5046,144 @@ void *publisher_thread_publish_bars(void *msg)
 
     auto handler = std::make_shared<MyHandler>(&server);
     server.addWebSocketHandler("/", handler);
+    //clients that offer permessage-deflate get compressed frames
+    if (publisher_deflate) {
+        server.setPerMessageDeflateEnabled(true);
+    }
     server.startListening(9090);
 
 	int server_fd = server.fd();
 	LOG(INFO)  << "Worker 3 (Publisher Thread) => Websocks server fd : " << server_fd << endl;
 	cout       << "Worker 3 (Publisher Thread) => Websocks server fd : " << server_fd << endl;
 
-	//Register server fd for any subscription activity
-	fds[1].fd = server_fd;
-	fds[1].events = POLLIN;
+	//the bar streams : the pipe from the FSM thread, or a socket per backend
+	vector<BarInbound> inbound;
+	if ( shard_backends.empty() ) {
+		inbound.push_back( BarInbound{ pfd_w2_w3[0], -1, false, 0, 0, {} } );
+	}
+	for (size_t k = 0; k < shard_backends.size(); k++) {
+		inbound.push_back( BarInbound{ shard_backends[k].bars_fd, (int) k, false, 0, 0, {} } );
+	}
+
+	//register the streams for incoming bars and the server fd for any subscription activity
+	int epfd = epoll_create1(0);
 
-	while (1) {
+	struct epoll_event ev;
 
-		int timeout_msecs =  60 * 1000;
-		int ret = poll(fds, numfds, timeout_msecs);
+	for (BarInbound & in : inbound) {
+		if ( fcntl( in.fd, F_SETFL, fcntl(in.fd, F_GETFL) | O_NONBLOCK ) < 0 ) {
+			LOG(INFO)  << "Worker 3 (Pubisher Thread) => Error setting nonblocking flag for incoming bars data pipe" << endl;
+			exit(0);
+		}
 
-		if (ret > 0) {
+		ev.events  = EPOLLIN | EPOLLET;
+		ev.data.fd = in.fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, in.fd, &ev);
+	}
 
-			//first check the websocket server for subscriptions
-			if (fds[1].revents & POLLIN) {
+	ev.events  = EPOLLIN | EPOLLET;
+	ev.data.fd = server_fd;
+	epoll_ctl(epfd, EPOLL_CTL_ADD, server_fd, &ev);
 
-    			server.poll(100);
-			}
-			
-			//subscription cache is update now. process the outgoing bars
-			if (fds[0].revents & POLLIN) {
+	//sharded mode: the control sockets, for the interest messages queued while they were full
+	for (const ShardBackend & backend : shard_backends) {
+		ev.events  = EPOLLOUT | EPOLLET;
+		ev.data.fd = backend.control_fd;
+		epoll_ctl(epfd, EPOLL_CTL_ADD, backend.control_fd, &ev);
+	}
 
-				if ( fcntl( fds[0].fd, F_SETFL, fcntl(fds[0].fd, F_GETFL) | O_NONBLOCK ) < 0 ) {
-					LOG(INFO)  << "Worker 3 (Pubisher Thread) => Error setting nonblocking flag for incoming bars data pipe" << endl;
-					exit(0);
-				}
+	if (publisher_busy_poll) {
+		LOG(INFO)  << "Worker 3 (Publisher Thread) => Busy polling the bars pipe and the websocket server" << endl;
+		cout       << "Worker 3 (Publisher Thread) => Busy polling the bars pipe and the websocket server" << endl;
+	}
 
-				int r;
-				while( (r = read(fds[0].fd, &barcntxt, sizeof(barcntxt))) > 0)  {
+	const int max_events = inbound.size() + shard_backends.size() + 1;
+	vector<struct epoll_event> events(max_events);
 
-					string symbol(barcntxt.sym);
-					//update the publishers bar cache
-					auto it = pubs_bar_cache.find(symbol);
-					bool bar_exists = ( it != pubs_bar_cache.end() );
+	bool bars_pending  = false;
+	bool server_pending = false;
 
-					if (bar_exists == true) {
-						//update existing entry in the publisher cache
-						it->second = barcntxt;
-					} else {
-						//insert new entry in the publisher cache
-						pubs_bar_cache.insert( pair<string, BarCntxt>(symbol, barcntxt) );
-					}
-					
-					//Check the subscriptions and push the bar to subscribers thru appopriate client connection socket descriptors
-					//LOG(INFO)  << "Publisher Thread => Read incoming bar : "
-					//     << "sym = "              << barcntxt.sym 
-					//     << ", bar_num = "        << barcntxt.bar_num
-					//     << ", bar_start_time = " << barcntxt.bar_start_time
-					//     << ", bar_close_time = " << barcntxt.bar_close_time
-					//     << ", bar_open = "       << barcntxt.bar_open
-					//     << ", bar_high = "       << barcntxt.bar_high
-					//     << ", bar_low  = "       << barcntxt.bar_low
-					//     << ", bar_close = "      << barcntxt.bar_close
-					//     << ", bar_volume = "     << barcntxt.bar_volume
-					//     << endl;
-					handler->publishBar(barcntxt);
+	auto last_report = chrono::steady_clock::now();
+	auto last_work   = chrono::steady_clock::now();
+
+	while (1) {
+
+		//do not sleep while there is work left over from the previous iteration, or while spinning after the last work (-w)
+		int timeout_msecs = (publisher_busy_poll or bars_pending or server_pending or spin_wait(last_work)) ? 0 : 60 * 1000;
+		int ret = epoll_wait(epfd, events.data(), max_events, timeout_msecs);
+
+		if (ret > 0) {
+			last_work = chrono::steady_clock::now();
+		}
+
+		for (int i = 0; i < ret; i++) {
+			if (events[i].data.fd == server_fd) {
+				server_pending = true;
+				continue;
+			}
+			for (BarInbound & in : inbound) {
+				if (in.fd == events[i].data.fd) {
+					in.pending = true;
+				}
+			}
+			for (size_t k = 0; k < shard_backends.size(); k++) {
+				if (shard_backends[k].control_fd == events[i].data.fd) {
+					shard_flush_interest(k);
 				}
 			}
 		}
-		else {
+
+		if (ret == 0 and timeout_msecs > 0) {
 			LOG(INFO)  << "Worker 3 (Publisher Thread) => Timeout occured while reading bars data. No bars data to read" << endl;
 			cout       << "Worker 3 (Publisher Thread) => Timeout occured while reading bars data. No bars data to read" << endl;
+			continue;
+		}
+
+		//first check the websocket server for subscriptions. poll(0) does not block
+		if (server_pending) {
+			server.poll(0);
+
+			//edge triggered. check whether the server still has work before waiting for the next edge
+			struct pollfd spfd;
+			spfd.fd      = server_fd;
+			spfd.events  = POLLIN;
+			spfd.revents = 0;
+			server_pending = ( poll(&spfd, 1, 0) > 0 );
+		}
+
+		//subscription cache is update now. process a bounded batch of outgoing bars from every stream that has some
+		bars_pending = false;
+		bool bars_read = false;
+		for (BarInbound & in : inbound) {
+			if (in.pending) {
+				publisher_read_bars(in, epfd, *handler);
+				bars_pending = bars_pending or in.pending;
+				bars_read    = true;
+			}
+		}
+
+		//the bars of this drain cycle go out as one frame per connection
+		if (bars_read) {
+			handler->flushFrames();
+		}
+
+		auto now = chrono::steady_clock::now();
+		if ( now >= last_report + chrono::seconds(publisher_stats_interval_secs) ) {
+			double secs = chrono::duration<double>(now - last_report).count();
+			handler->reportStats(secs);
+
+			//sharded mode: the bar rate of every backend
+			for (BarInbound & in : inbound) {
+				if (in.shard >= 0) {
+					stringstream ss;
+					ss << "Worker 3 (Publisher Thread) => shard " << in.shard << " : " << (in.fd >= 0 ? "up" : "down") 
+					   << ", messages/sec = " << in.messages / secs << endl;
+					cout      << ss.str();
+					LOG(INFO) << ss.str();
+				}
+				in.messages = 0;
+			}
+			last_report = now;
 		}
 	}
 }
-
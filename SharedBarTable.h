@@ -0,0 +1,222 @@
+// Shared memory table of the latest OHLC bars, for consumers running on the same host as the AnalyticalServer
+
+
+/*
+	The server (publisher thread, the only writer) keeps a POSIX shared memory object with one slot per symbol. A slot holds the
+	latest bar of the symbol and a ring of its last SHM_BAR_HISTORY closed bars, guarded by a seqlock. Readers map the object
+	read-only and copy a slot without any lock and without any work on the server side:
+
+		SharedBarTableReader table;
+		if ( table.open("/ohlc_bars") ) {
+			ShmBar bar;
+			if ( table.latest("XETHXXBT", bar) ) { ... }
+
+			ShmBar closed[SHM_BAR_HISTORY];
+			size_t n = table.closed("XETHXXBT", closed, SHM_BAR_HISTORY);   //oldest first
+		}
+
+	The symbols are placed by open addressing (FNV-1a hash, linear probing). A slot is never freed once a symbol got it.
+*/
+
+
+#ifndef SHARED_BAR_TABLE_H
+#define SHARED_BAR_TABLE_H
+
+#include <atomic>
+#include <algorithm>
+#include <cstdint>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+
+//Layout version, bumped on any change of the structures below
+const uint32_t SHM_BAR_TABLE_VERSION = 1;
+
+//Closed bars kept per symbol
+const uint32_t SHM_BAR_HISTORY = 16;
+
+
+//Bar of the table. type is the Bar_Type of the server (0 CLOSING_BAR, 1 TRADE_BAR, 2 TIMER_EXP_CLOSING_BAR, 4 EMPTY_BARS_GAP).
+//As in the ohlc_notify messages, bar_close is 0.0 for the bars that are not closed yet
+struct ShmBar {
+	uint32_t type;
+	uint32_t bar_num;
+	uint64_t bar_start_time;
+	uint64_t bar_close_time;
+	double   bar_open;
+	double   bar_high;
+	double   bar_low;
+	double   bar_close;
+	double   bar_volume;
+};
+
+
+//Slot of a symbol. seq is odd while the writer updates the slot. used is set once the symbol is written
+struct ShmBarSlot {
+	std::atomic<uint32_t> used;
+	std::atomic<uint32_t> seq;
+	char                  sym[16];
+	uint64_t              closed_bars;               //closed bars written so far. The newest is closed[(closed_bars - 1) % SHM_BAR_HISTORY]
+	ShmBar                latest;
+	ShmBar                closed[SHM_BAR_HISTORY];
+};
+
+
+//Table header, followed by num_slots slots
+struct ShmBarTableHeader {
+	char                  magic[8];     //"OHLCSHM" and the terminating 0
+	uint32_t              version;
+	uint32_t              num_slots;    //power of 2
+	std::atomic<uint32_t> used_slots;
+	uint32_t              reserved;
+};
+
+
+inline size_t shm_bar_table_size(uint32_t num_slots) {
+	return sizeof(ShmBarTableHeader) + (size_t) num_slots * sizeof(ShmBarSlot);
+}
+
+
+inline ShmBarSlot *shm_bar_table_slots(ShmBarTableHeader *table) {
+	return reinterpret_cast<ShmBarSlot *>(table + 1);
+}
+
+
+inline uint32_t shm_bar_table_hash(const char *sym) {
+	uint32_t hash = 2166136261U;
+	for ( ; *sym; sym++) {
+		hash = (hash ^ (unsigned char) *sym) * 16777619U;
+	}
+	return hash;
+}
+
+
+//Read-only client of the table. Lock free: a read retries while the writer updates the slot
+class SharedBarTableReader {
+public:
+	SharedBarTableReader() : _table(NULL), _size(0) {
+	}
+
+	~SharedBarTableReader() {
+		close();
+	}
+
+	bool open(const char *name) {
+		close();
+
+		int fd = shm_open(name, O_RDONLY, 0);
+		if (fd < 0) {
+			return false;
+		}
+
+		struct stat st;
+		if ( fstat(fd, &st) < 0 or (size_t) st.st_size < sizeof(ShmBarTableHeader) ) {
+			::close(fd);
+			return false;
+		}
+
+		void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (addr == MAP_FAILED) {
+			return false;
+		}
+
+		_table = static_cast<ShmBarTableHeader *>(addr);
+		_size  = st.st_size;
+
+		if ( strcmp(_table->magic, "OHLCSHM") != 0 or _table->version != SHM_BAR_TABLE_VERSION or
+		     _size < shm_bar_table_size(_table->num_slots) ) {
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close() {
+		if (_table != NULL) {
+			munmap(_table, _size);
+			_table = NULL;
+		}
+	}
+
+	//Latest bar of the symbol. false if the symbol has no bars
+	bool latest(const char *sym, ShmBar & bar) const {
+		const ShmBarSlot *slot = find(sym);
+		if (slot == NULL) {
+			return false;
+		}
+
+		uint32_t seq;
+		do {
+			seq = begin_read(slot);
+			bar = slot->latest;
+		} while ( !end_read(slot, seq) );
+		return true;
+	}
+
+	//Copy up to max closed bars of the symbol, oldest first. Returns the number of bars copied
+	size_t closed(const char *sym, ShmBar *bars, size_t max) const {
+		const ShmBarSlot *slot = find(sym);
+		if (slot == NULL) {
+			return 0;
+		}
+
+		size_t n;
+		uint32_t seq;
+		do {
+			seq = begin_read(slot);
+			uint64_t total = slot->closed_bars;
+			n = (size_t) std::min<uint64_t>( std::min<uint64_t>(total, SHM_BAR_HISTORY), max );
+			for (size_t i = 0; i < n; i++) {
+				bars[i] = slot->closed[ (total - n + i) % SHM_BAR_HISTORY ];
+			}
+		} while ( !end_read(slot, seq) );
+		return n;
+	}
+
+	//Number of symbols in the table
+	uint32_t symbols() const {
+		return (_table == NULL) ? 0 : _table->used_slots.load(std::memory_order_acquire);
+	}
+
+private:
+	const ShmBarSlot *find(const char *sym) const {
+		if (_table == NULL) {
+			return NULL;
+		}
+
+		const ShmBarSlot *slots = shm_bar_table_slots(_table);
+		uint32_t mask = _table->num_slots - 1;
+
+		for (uint32_t i = 0, pos = shm_bar_table_hash(sym) & mask; i <= mask; i++, pos = (pos + 1) & mask) {
+			const ShmBarSlot & slot = slots[pos];
+			if ( slot.used.load(std::memory_order_acquire) == 0 ) {
+				return NULL;
+			}
+			if ( strncmp(slot.sym, sym, sizeof(slot.sym)) == 0 ) {
+				return &slot;
+			}
+		}
+		return NULL;
+	}
+
+	static uint32_t begin_read(const ShmBarSlot *slot) {
+		uint32_t seq;
+		while ( (seq = slot->seq.load(std::memory_order_acquire)) & 1 ) {
+		}
+		return seq;
+	}
+
+	static bool end_read(const ShmBarSlot *slot, uint32_t seq) {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot->seq.load(std::memory_order_relaxed) == seq;
+	}
+
+	ShmBarTableHeader *_table;
+	size_t             _size;
+};
+
+#endif
@@ -9,7 +9,29 @@ echo "Setting LD_LIBRARY_PATH..done"
 
 echo "Building AnalyticalServer executable.."
 
-g++ -I./seasocks/src/main/c/ -I./g2log/g2log/src  -L./seasocks/build/src/main/c -L./g2log/g2log/build AnalyticalServer.cpp -lseasocks -lpthread -llib_g2logger -o AnalyticalServer
+#zstd trade files are supported when libzstd is installed
+ZSTD_CFLAGS=""
+ZSTD_LIBS=""
+if [ -f /usr/include/zstd.h ]; then
+	ZSTD_CFLAGS="-DWITH_ZSTD"
+	ZSTD_LIBS="-lzstd"
+fi
+
+#NUMA aware thread placement (-A) when libnuma is installed
+NUMA_CFLAGS=""
+NUMA_LIBS=""
+if [ -f /usr/include/numa.h ]; then
+	NUMA_CFLAGS="-DWITH_NUMA"
+	NUMA_LIBS="-lnuma"
+fi
+
+#per event trace of the FSM in the log. FSM_TRACE=0 ./build.sh compiles it out (benchmarks, fast replays)
+TRACE_CFLAGS=""
+if [ "$FSM_TRACE" = "0" ]; then
+	TRACE_CFLAGS="-DFSM_NO_TRACE"
+fi
+
+g++ $ZSTD_CFLAGS $NUMA_CFLAGS $TRACE_CFLAGS -I./seasocks/src/main/c/ -I./g2log/g2log/src  -L./seasocks/build/src/main/c -L./g2log/g2log/build AnalyticalServer.cpp -lseasocks -lpthread -llib_g2logger -lz -lrt $ZSTD_LIBS $NUMA_LIBS -o AnalyticalServer
 
 chmod +x AnalyticalServer
 
@@ -0,0 +1,26 @@
+#!/bin/sh
+
+#Check that the batch mode writes the same bars whatever the shard count: the rows of every symbol, in order, with -n 1 and
+#with -n <shards>. Usage: ./check_batch.sh <trades file> [<shards>]
+
+TRADES=${1:?usage: $0 <trades file> [<shards>]}
+SHARDS=${2:-4}
+OUT=`mktemp -d`
+
+./AnalyticalServer -f $TRADES -o $OUT/bars1.csv -n 1 > /dev/null || exit 1
+./AnalyticalServer -f $TRADES -o $OUT/bars.csv -n $SHARDS > /dev/null || exit 1
+
+#the rows of a symbol are in one file, in publishing order. A stable sort on the symbol keeps that order
+grep -hv '^type,' $OUT/bars1.csv   | sort -s -t, -k2,2 > $OUT/rows1
+grep -hv '^type,' $OUT/bars.csv.*  | sort -s -t, -k2,2 > $OUT/rows
+
+if cmp -s $OUT/rows1 $OUT/rows; then
+	echo "Batch mode check : -n 1 and -n $SHARDS bars are identical (`wc -l < $OUT/rows1` rows)"
+	rm -rf $OUT
+	exit 0
+fi
+
+echo "Batch mode check : -n 1 and -n $SHARDS bars differ"
+diff $OUT/rows1 $OUT/rows | head -20
+rm -rf $OUT
+exit 1